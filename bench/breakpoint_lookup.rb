@@ -0,0 +1,36 @@
+#!/usr/bin/env ruby
+# Measures the per-line cost of breakpoint lookup with a growing number of
+# breakpoints set. The cost should stay flat from 1 to 10,000 breakpoints.
+#
+#   ruby -Iext -Ilib bench/breakpoint_lookup.rb
+require 'benchmark'
+require 'debase'
+
+ITERATIONS = Integer(ENV['ITERATIONS'] || 200_000)
+COUNTS = [1, 10, 100, 1_000, 10_000]
+
+def traced_loop(n)
+  i = 0
+  while i < n
+    i += 1
+  end
+  i
+end
+
+Debase.start_
+results = COUNTS.map do |count|
+  Debase.breakpoints.clear
+  count.times { |line| Debase.add_breakpoint("/nonexistent/bench_target.rb", line + 1) }
+
+  find = Benchmark.realtime do
+    ITERATIONS.times { Debase::Breakpoint.find(Debase.breakpoints, __FILE__, 15, nil) }
+  end
+  line = Benchmark.realtime { traced_loop(ITERATIONS) }
+
+  [count, find * 1e9 / ITERATIONS, line * 1e9 / (ITERATIONS * 2)]
+end
+Debase.breakpoints.clear
+Debase.stop
+
+puts format("%12s %16s %16s", "breakpoints", "find, ns/call", "traced, ns/line")
+results.each { |count, find, line| puts format("%12d %16.1f %16.1f", count, find, line) }
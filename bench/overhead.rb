@@ -0,0 +1,130 @@
+#!/usr/bin/env ruby
+# Measures debase overhead on several workloads in every debugger mode and
+# prints the results as JSON, so runs of different commits can be compared.
+#
+#   rake bench
+#   ruby -Iext -Ilib bench/overhead.rb [output.json]
+#
+# ITERATIONS scales the workloads, REPEAT sets how many runs the best time is taken of.
+require 'json'
+require 'debase'
+
+ITERATIONS = Integer(ENV['ITERATIONS'] || 100_000)
+REPEAT = Integer(ENV['REPEAT'] || 3)
+
+class NullHandler
+  def at_line(context, file, line); end
+  def at_breakpoint(context, breakpoint); end
+  def at_catchpoint(context, exception); end
+  def at_return(context, file, line); end
+end
+
+class BenchError < StandardError; end
+
+module Workloads
+  module_function
+
+  def line_heavy(n)
+    i = 0
+    x = 0
+    while i < n
+      x += i
+      x -= 1
+      i += 1
+    end
+    x
+  end
+
+  def callee(i)
+    i + 1
+  end
+
+  def call_heavy(n)
+    i = 0
+    i = callee(i) while i < n
+    i
+  end
+
+  def c_call_heavy(n)
+    array = [3, 1, 2]
+    n.times { array.max; array.size; array.first }
+  end
+
+  def exception_heavy(n)
+    (n / 10).times do
+      begin
+        raise BenchError
+      rescue BenchError
+      end
+    end
+  end
+
+  def threads(n)
+    4.times.map { Thread.new { line_heavy(n / 4) } }.each(&:join)
+  end
+end
+
+WORKLOADS = [:line_heavy, :call_heavy, :c_call_heavy, :exception_heavy, :threads]
+
+MODES = {
+  not_started: -> {},
+  started: -> { Debase.start_ },
+  breakpoints_1: -> { Debase.start_; add_breakpoints(1) },
+  breakpoints_100: -> { Debase.start_; add_breakpoints(100) },
+  breakpoints_1000: -> { Debase.start_; add_breakpoints(1000) },
+  conditional_breakpoint: -> {
+    Debase.start_
+    Debase.add_breakpoint(__FILE__, Workloads.method(:line_heavy).source_location[1] + 4, "i < 0")
+  },
+  catchpoint: -> { Debase.start_; Debase.add_catchpoint('NoSuchBenchError') },
+  stepping: -> {
+    Debase.start_
+    # a step which never completes keeps line events of this thread traced
+    Debase.current_context.stop_next = 1 << 30
+  },
+}
+
+# breakpoints on lines which are never reached, half of them in this file
+def add_breakpoints(count)
+  count.times { |i| Debase.add_breakpoint(i.even? ? __FILE__ : "/nonexistent/bench_#{i}.rb", 100_000 + i) }
+end
+
+def teardown
+  return unless Debase.started?
+  Debase.breakpoints.clear
+  Debase.clear_catchpoints
+  Debase.stop
+end
+
+def measure(workload)
+  (1..REPEAT).map do
+    start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    Workloads.send(workload, ITERATIONS)
+    Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+  end.min
+end
+
+Debase.handler = NullHandler.new
+results = []
+WORKLOADS.each do |workload|
+  baseline = nil
+  MODES.each do |mode, setup|
+    begin
+      setup.call
+      seconds = measure(workload)
+    ensure
+      teardown
+    end
+    baseline ||= seconds
+    results << {workload: workload, mode: mode, seconds: seconds.round(6), overhead: (seconds / baseline).round(2)}
+  end
+end
+
+report = {
+  ruby: RUBY_DESCRIPTION,
+  commit: (`git rev-parse HEAD 2>/dev/null`.strip rescue nil),
+  iterations: ITERATIONS,
+  results: results,
+}
+json = JSON.pretty_generate(report)
+ARGV[0] ? File.write(ARGV[0], json) : puts(json)
@@ -22,29 +22,110 @@ __func_to_set_breakpoint_at()
 }
 #endif
 
+/* number of times the attach safe point was reached */
+static volatile int attach_hits = 0;
+
 static void
-__catch_line_event(rb_event_flag_t evflag, VALUE data, VALUE self, ID mid, VALUE klass)
+__catch_postponed_job(void *data)
 {
-    (void)sizeof(evflag);
-    (void)sizeof(self);
-    (void)sizeof(mid);
-    (void)sizeof(klass);
+    (void)sizeof(data);
 
-    rb_remove_event_hook(__catch_line_event);
-    if (rb_during_gc())
-        return;
+    attach_hits++;
     __func_to_set_breakpoint_at();
 }
 
+#if !defined(_WIN32) && defined(SIGVTALRM)
+#define ATTACH_WAKE_UP_THREAD
+
+/*
+A thread blocked in IO or sleeping checks postponed jobs only when it is
+interrupted. Ruby interrupts blocking calls with SIGVTALRM, so the thread
+which requested the attach is signalled until the job runs. The signal is
+sent from a helper thread because the debugger resumes the process only
+after debase_start_attach returns.
+*/
+typedef struct
+{
+    pthread_t target;
+    /* attach_hits before the job was triggered */
+    int hits;
+} wake_up_t;
+
+static void *
+__wake_up_thread(void *data)
+{
+    wake_up_t wake_up = *(wake_up_t *)data;
+    int i;
+
+    free(data);
+    for (i = 0; i < 200 && attach_hits == wake_up.hits; i++)
+    {
+        usleep(10000);
+        pthread_kill(wake_up.target, SIGVTALRM);
+    }
+    return NULL;
+}
+
+static void
+__wake_up(int hits)
+{
+    struct sigaction action;
+    wake_up_t *wake_up;
+    pthread_t thread;
+
+    /* the default action of SIGVTALRM terminates the process */
+    if (sigaction(SIGVTALRM, NULL, &action) != 0 ||
+        action.sa_handler == SIG_DFL || action.sa_handler == SIG_IGN)
+        return;
+
+    wake_up = malloc(sizeof(wake_up_t));
+    if (wake_up == NULL)
+        return;
+    wake_up->target = pthread_self();
+    wake_up->hits = hits;
+    if (pthread_create(&thread, NULL, __wake_up_thread, wake_up) != 0)
+    {
+        free(wake_up);
+        return;
+    }
+    pthread_detach(thread);
+}
+#endif
+
+/*
+Schedules a call of __func_to_set_breakpoint_at at the next safe point of
+the VM. A postponed job runs at the next interrupt check, no event hook is
+installed, so the rest of the process runs at full speed.
+*/
 int
 debase_start_attach()
 {
+    int hits;
+
     if (rb_during_gc())
         return 1;
-    rb_add_event_hook(__catch_line_event, RUBY_EVENT_LINE, (VALUE) NULL);
+    /* the job can run before the wake up thread starts */
+    hits = attach_hits;
+#ifdef DEBASE_POSTPONED_JOB_PREREGISTER
+    rb_postponed_job_trigger(rb_postponed_job_preregister(0, __catch_postponed_job, NULL));
+#else
+    rb_postponed_job_register_one(0, __catch_postponed_job, NULL);
+#endif
+#ifdef ATTACH_WAKE_UP_THREAD
+    __wake_up(hits);
+#else
+    (void)hits;
+#endif
     return 0;
 }
 
+/* used only by tests */
+int
+debase_attach_test_hits()
+{
+    return attach_hits;
+}
+
 void
 debase_rb_eval(const char *string_to_eval)
 {
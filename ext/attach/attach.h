@@ -3,8 +3,21 @@
 
 #include <ruby.h>
 #include <ruby/debug.h>
+#include <ruby/version.h>
+#include <signal.h>
+#include <stdlib.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+/* rb_postponed_job_register_one is deprecated since Ruby 3.3 */
+#if defined(HAVE_RB_POSTPONED_JOB_PREREGISTER) || RUBY_API_VERSION_CODE >= 30300
+#define DEBASE_POSTPONED_JOB_PREREGISTER
+#endif
 
 int debase_start_attach();
 void debase_rb_eval(const char *);
+int debase_attach_test_hits();
 
 #endif //__ATTACH_H__
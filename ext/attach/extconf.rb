@@ -50,6 +50,7 @@ if ENV['debase_debug']
 end
 
 dir_config("ruby")
+have_func("rb_postponed_job_preregister", "ruby/debug.h")
 if !Debase::RubyCoreSource.create_makefile_with_core(hdrs, "attach")
   STDERR.print("Makefile creation failed\n")
   STDERR.print("*************************************************************\n\n")
@@ -1,4 +1,5 @@
 #include <debase_internals.h>
+#include <ruby/encoding.h>
 
 #ifdef _WIN32
 #include <ctype.h>
@@ -13,7 +14,48 @@
 static VALUE cBreakpoint;
 static int breakpoint_max;
 
+/* Breakpoints index: line number -> array of breakpoints set on that line.
+   It is built for a single breakpoints array. indexed_snapshot is a copy of
+   the array contents the index was built for, changes of Debase.breakpoints
+   made outside Breakpoint.add and Breakpoint.remove make it differ, so a
+   stale index is never used. */
+static VALUE breakpoints_index = Qnil;
+static VALUE indexed_breakpoints = Qnil;
+static VALUE indexed_snapshot = Qnil;
+static long indexed_count = 0;
+/* number of indexed breakpoints which do not need the global line tracepoint */
+static long targeted_count = 0;
+static long logpoint_count = 0;
+
+/* Exception class -> names of the matching catchpoints, nearest ancestor first,
+   or false, filled on raise.
+   Dropped when catchpoints change, see Debase.invalidate_catchpoints. */
+static VALUE catchpoint_cache = Qnil;
+static VALUE cached_catchpoints = Qnil;
+static long cached_catchpoints_size = -1;
+/* catchpoint name -> [exact, message] */
+static VALUE catchpoint_options = Qnil;
+
 static ID idEval;
+static ID idMesg;
+static ID idMessage;
+static ID idCompareByIdentity;
+static ID idInstanceExec;
+static ID idModuleEval;
+static ID idReceiver;
+static ID idLocalVariables;
+static ID idHitGE;
+static ID idHitEQ;
+static ID idHitMod;
+static VALUE toplevel_binding = Qnil;
+#ifdef DEBASE_TARGETED_TRACEPOINTS
+static ID idEnable;
+static ID idPath;
+static ID idTarget;
+static ID idTargetLine;
+#endif
+
+int filename_cmp_impl(VALUE source, char *file);
 
 static VALUE
 eval_expression(VALUE args)
@@ -21,38 +63,348 @@ eval_expression(VALUE args)
   return rb_funcall2(rb_mKernel, idEval, 2, RARRAY_PTR(args));
 }
 
+static inline int
+is_exact_catchpoint(VALUE mod_name)
+{
+  VALUE options;
+
+  options = rb_hash_lookup(catchpoint_options, mod_name);
+  return options != Qnil && RTEST(RARRAY_AREF(options, 0));
+}
+
+static VALUE
+resolve_catchpoints(VALUE catchpoints, VALUE expn_class)
+{
+  VALUE ancestors;
+  VALUE mod_name;
+  VALUE names;
+  int i;
+
+  names = Qfalse;
+  ancestors = rb_mod_ancestors(expn_class);
+  for(i = 0; i < RARRAY_LENINT(ancestors); i++)
+  {
+    mod_name = rb_mod_name(rb_ary_entry(ancestors, i));
+    if (mod_name == Qnil || !rb_hash_lookup2(catchpoints, mod_name, 0)) continue;
+    if (i > 0 && is_exact_catchpoint(mod_name)) continue;
+    if (names == Qfalse) names = rb_ary_new();
+    rb_ary_push(names, mod_name);
+  }
+  return names;
+}
+
+static int
+check_catchpoint_message(VALUE mod_name, VALUE exception)
+{
+  VALUE options;
+  VALUE pattern;
+  VALUE message;
+
+  options = rb_hash_lookup(catchpoint_options, mod_name);
+  if (options == Qnil) return 1;
+  pattern = RARRAY_AREF(options, 1);
+  if (pattern == Qnil) return 1;
+
+  message = rb_attr_get(exception, idMesg);
+  if (!RB_TYPE_P(message, T_STRING))
+    message = rb_check_string_type(rb_funcall(exception, idMessage, 0));
+  return message != Qnil && rb_memsearch(RSTRING_PTR(pattern), RSTRING_LEN(pattern),
+    RSTRING_PTR(message), RSTRING_LEN(message), rb_enc_get(message)) >= 0;
+}
+
 extern VALUE
 catchpoint_hit_count(VALUE catchpoints, VALUE exception, VALUE *exception_name) {
-  VALUE ancestors;
   VALUE expn_class;
-  VALUE aclass;
+  VALUE names;
   VALUE mod_name;
   VALUE hit_count;
   int i;
 
-  if (catchpoints == Qnil /*|| st_get_num_entries(RHASH_TBL(rdebug_catchpoints)) == 0)*/)
+  if (catchpoints == Qnil || RHASH_SIZE(catchpoints) == 0)
     return Qnil;
+  if (catchpoints != cached_catchpoints || (long)RHASH_SIZE(catchpoints) != cached_catchpoints_size)
+  {
+    catchpoint_cache = rb_hash_new();
+    rb_funcall(catchpoint_cache, idCompareByIdentity, 0);
+    cached_catchpoints = catchpoints;
+    cached_catchpoints_size = RHASH_SIZE(catchpoints);
+  }
+
   expn_class = rb_obj_class(exception);
-  ancestors = rb_mod_ancestors(expn_class);
-  for(i = 0; i < RARRAY_LENINT(ancestors); i++)
+  names = rb_hash_lookup2(catchpoint_cache, expn_class, Qundef);
+  if (names == Qundef)
   {
-    aclass    = rb_ary_entry(ancestors, i);
-    mod_name  = rb_mod_name(aclass);
+    names = resolve_catchpoints(catchpoints, expn_class);
+    rb_hash_aset(catchpoint_cache, expn_class, names);
+  }
+  if (names == Qfalse)
+    return Qnil;
+
+  /* a catchpoint whose message does not match leaves the exception to the next ancestor's one */
+  for (i = 0; i < RARRAY_LENINT(names); i++)
+  {
+    mod_name = RARRAY_AREF(names, i);
+    if (!check_catchpoint_message(mod_name, exception)) continue;
     hit_count = rb_hash_aref(catchpoints, mod_name);
-    if(hit_count != Qnil)
-    {
-      *exception_name = mod_name;
-      return hit_count;
-    }
+    if (hit_count == Qnil) continue;
+    *exception_name = mod_name;
+    return hit_count;
   }
   return Qnil;
 }
 
+/*
+ *  call-seq:
+ *    Debase.invalidate_catchpoints
+ *
+ *  Drops resolved exception classes, should be called when catchpoints are changed.
+ */
+static VALUE
+Debase_invalidate_catchpoints(VALUE self)
+{
+  cached_catchpoints = Qnil;
+  invalidate_trace_points();
+  return Qnil;
+}
+
+/*
+ *  call-seq:
+ *    Debase.set_catchpoint_options(name, exact, message)
+ *
+ *  Makes the catchpoint stop only on the exception class itself (not its subclasses)
+ *  if exact is true and only on exceptions with the message containing the given string.
+ */
+static VALUE
+Debase_set_catchpoint_options(VALUE self, VALUE name, VALUE exact, VALUE message)
+{
+  name = rb_str_new_frozen(StringValue(name));
+  if (!RTEST(exact) && NIL_P(message))
+    rb_hash_delete(catchpoint_options, name);
+  else
+    rb_hash_aset(catchpoint_options, name, rb_ary_new3(2, RTEST(exact) ? Qtrue : Qfalse,
+      NIL_P(message) ? Qnil : rb_str_new_frozen(StringValue(message))));
+  cached_catchpoints = Qnil;
+  invalidate_trace_points();
+  return Qnil;
+}
+
+static void
+reset_compiled_expr(compiled_expr_t *compiled_expr)
+{
+  compiled_expr->proc = Qnil;
+  compiled_expr->error = Qnil;
+  compiled_expr->klass = Qnil;
+  compiled_expr->use_eval = 0;
+}
+
+/* checks that name is used in the expression as a separate word */
+static int
+expr_mentions(VALUE expr, const char *name)
+{
+  const char *ptr, *start, *end;
+  long name_len;
+
+  name_len = strlen(name);
+  start = RSTRING_PTR(expr);
+  end = start + RSTRING_LEN(expr);
+  for (ptr = start; ptr + name_len <= end; ptr++) {
+    if (memcmp(ptr, name, name_len) != 0) continue;
+    if (ptr > start && (ISALNUM(ptr[-1]) || ptr[-1] == '_' || ptr[-1] == '@' || ptr[-1] == '$')) continue;
+    if (ptr + name_len < end && (ISALNUM(ptr[name_len]) || ptr[name_len] == '_')) continue;
+    return 1;
+  }
+  return 0;
+}
+
+/* The compiled form assigns to its own copies of the locals, so expressions
+   which may assign (including op-assigns) are evaluated by Kernel#eval.
+   Comparisons like ==, !=, <=, >=, =~ and => are not assignments. The scan
+   is conservative, string literals are skipped except their interpolations. */
+static int
+expr_needs_eval(VALUE expr)
+{
+  const char *ptr, *start, *end;
+  char prev, next;
+  char quote;
+  int interpolation;
+
+  start = RSTRING_PTR(expr);
+  end = start + RSTRING_LEN(expr);
+  quote = 0;
+  /* brace depth inside #{} of a double quoted string */
+  interpolation = 0;
+  for (ptr = start; ptr < end; ptr++) {
+    prev = ptr > start ? ptr[-1] : 0;
+    next = ptr + 1 < end ? ptr[1] : 0;
+    if (quote) {
+      if (*ptr == '\\') {
+        ptr++;
+      } else if (*ptr == quote) {
+        quote = 0;
+      } else if (quote == '"' && *ptr == '#' && next == '{') {
+        quote = 0;
+        interpolation = 1;
+        ptr++;
+      }
+      continue;
+    }
+    if (*ptr == '\'' || *ptr == '"') {
+      /* strings nested in interpolations are not followed */
+      if (interpolation) return 1;
+      quote = *ptr;
+      continue;
+    }
+    if (interpolation && *ptr == '{') interpolation++;
+    if (interpolation && *ptr == '}' && --interpolation == 0) {
+      quote = '"';
+      continue;
+    }
+    if (*ptr == '=' && prev != '=' && prev != '!' && prev != '<' && prev != '>' &&
+      next != '=' && next != '~' && next != '>')
+      return 1;
+  }
+  return 0;
+}
+
+/* Compiles the expression without running it, so syntax errors are reported
+   when the breakpoint is set. Locals of the frame are known only at a hit,
+   the lambda evaluated then is built by compile_expr. */
+static void
+check_expr_syntax(compiled_expr_t *compiled_expr, VALUE expr)
+{
+  VALUE source;
+  int error;
+
+  reset_compiled_expr(compiled_expr);
+  if (NIL_P(expr)) return;
+  source = rb_str_new2("lambda { (");
+  rb_str_append(source, expr);
+  rb_str_cat2(source, "\n) }");
+
+  rb_protect(eval_expression, rb_ary_new3(2, source, toplevel_binding), &error);
+  if (error) {
+    compiled_expr->error = rb_funcall(rb_errinfo(), rb_intern("message"), 0);
+    rb_set_errinfo(Qnil);
+    rb_warn("debase: can't compile expression '%s': %s", RSTRING_PTR(expr), RSTRING_PTR(compiled_expr->error));
+  }
+}
+
+static VALUE
+module_eval_expression(VALUE args)
+{
+  return rb_funcall(RARRAY_AREF(args, 1), idModuleEval, 1, RARRAY_AREF(args, 0));
+}
+
+/* Builds a lambda which reads the locals used by the expression from the binding:
+     lambda { |__debase_binding| a = __debase_binding.local_variable_get(:a); (expr) }
+   It is called with the frame's self, so methods and instance variables are resolved too.
+   It is compiled in the frame's class, so constants are looked up in the class,
+   its ancestors and the top level. */
+static void
+compile_expr(compiled_expr_t *compiled_expr, VALUE expr, VALUE binding, VALUE klass)
+{
+  VALUE locals;
+  VALUE source;
+  VALUE result;
+  const char *name;
+  int error;
+  int i;
+
+  locals = rb_funcall(binding, idLocalVariables, 0);
+  source = rb_str_new2("lambda { |__debase_binding| ");
+  for (i = 0; i < RARRAY_LENINT(locals); i++) {
+    name = rb_id2name(SYM2ID(rb_ary_entry(locals, i)));
+    if (!expr_mentions(expr, name)) continue;
+    rb_str_catf(source, "%s = __debase_binding.local_variable_get(:%s); ", name, name);
+  }
+  rb_str_cat2(source, "(");
+  rb_str_append(source, expr);
+  rb_str_cat2(source, "\n) }");
+
+  result = rb_protect(module_eval_expression, rb_ary_new3(2, source, klass), &error);
+  if (error) {
+    compiled_expr->error = rb_funcall(rb_errinfo(), rb_intern("message"), 0);
+    rb_set_errinfo(Qnil);
+    rb_warn("debase: can't compile expression '%s': %s", RSTRING_PTR(expr), RSTRING_PTR(compiled_expr->error));
+    return;
+  }
+  if (expr_needs_eval(expr)) {
+    compiled_expr->use_eval = 1;
+  } else {
+    compiled_expr->proc = result;
+    compiled_expr->klass = klass;
+  }
+}
+
+static VALUE
+call_compiled_expr(VALUE args)
+{
+  VALUE binding;
+
+  binding = RARRAY_AREF(args, 1);
+  return rb_funcall_with_block(rb_funcall(binding, idReceiver, 0), idInstanceExec, 1, &binding, RARRAY_AREF(args, 0));
+}
+
+static inline int
+is_name_error(VALUE exception)
+{
+  return rb_obj_class(exception) == rb_eNameError;
+}
+
+/* Evaluates the expression against the binding, compiling it on first use.
+   If the compiled form can't resolve a name (a local variable defined later),
+   the following evaluations use Kernel#eval. The failed evaluation is not
+   repeated, the expression may have side effects. */
+static VALUE
+eval_compiled_expr(compiled_expr_t *compiled_expr, VALUE expr, VALUE binding, VALUE klass, int *error)
+{
+  VALUE result;
+
+  *error = 0;
+  if (compiled_expr->error != Qnil) {
+    *error = 1;
+    return Qnil;
+  }
+
+  /* a block at the line can run in another class, e.g. by class_eval */
+  if (!compiled_expr->use_eval && (compiled_expr->proc == Qnil || compiled_expr->klass != klass)) {
+    compile_expr(compiled_expr, expr, binding, klass);
+    if (compiled_expr->error != Qnil) {
+      *error = 1;
+      return Qnil;
+    }
+  }
+  if (!compiled_expr->use_eval) {
+    result = rb_protect(call_compiled_expr, rb_ary_new3(2, compiled_expr->proc, binding), error);
+    if (!*error) return result;
+    if (is_name_error(rb_errinfo())) {
+      compiled_expr->use_eval = 1;
+      compiled_expr->proc = Qnil;
+    }
+    rb_set_errinfo(Qnil);
+    return Qnil;
+  }
+
+  result = rb_protect(eval_expression, rb_ary_new3(2, expr, binding), error);
+  if (*error) rb_set_errinfo(Qnil);
+  return result;
+}
+
 static void
 Breakpoint_mark(breakpoint_t *breakpoint)
 {
   rb_gc_mark(breakpoint->source);
   rb_gc_mark(breakpoint->expr);
+  rb_gc_mark(breakpoint->compiled_expr.proc);
+  rb_gc_mark(breakpoint->compiled_expr.error);
+  rb_gc_mark(breakpoint->compiled_expr.klass);
+  rb_gc_mark(breakpoint->thread);
+  rb_gc_mark(breakpoint->log_message);
+  rb_gc_mark(breakpoint->log_expr);
+  rb_gc_mark(breakpoint->compiled_log.proc);
+  rb_gc_mark(breakpoint->compiled_log.error);
+  rb_gc_mark(breakpoint->compiled_log.klass);
+  rb_gc_mark(breakpoint->tracepoints);
 }
 
 static VALUE
@@ -61,6 +413,14 @@ Breakpoint_create(VALUE klass)
     breakpoint_t *breakpoint;
 
     breakpoint = ALLOC(breakpoint_t);
+    breakpoint->source = Qnil;
+    breakpoint->expr = Qnil;
+    reset_compiled_expr(&breakpoint->compiled_expr);
+    breakpoint->thread = Qnil;
+    breakpoint->log_message = Qnil;
+    breakpoint->log_expr = Qnil;
+    reset_compiled_expr(&breakpoint->compiled_log);
+    breakpoint->tracepoints = Qnil;
     return Data_Wrap_Struct(klass, Breakpoint_mark, xfree, breakpoint);
 }
 
@@ -75,15 +435,280 @@ Breakpoint_initialize(VALUE self, VALUE source, VALUE pos, VALUE expr)
   breakpoint->line = FIX2INT(pos);
   breakpoint->enabled = Qtrue;
   breakpoint->expr = NIL_P(expr) ? expr : StringValue(expr);
+  check_expr_syntax(&breakpoint->compiled_expr, breakpoint->expr);
+  breakpoint->hit_count = 0;
+  breakpoint->hit_value = 0;
+  breakpoint->hit_condition = HIT_COND_NONE;
+  breakpoint->thread = Qnil;
+  breakpoint->log_message = Qnil;
+  breakpoint->log_expr = Qnil;
+  reset_compiled_expr(&breakpoint->compiled_log);
+  breakpoint->match_file_id = -1;
+  breakpoint->match_generation = -1;
+  breakpoint->match_result = 0;
+  breakpoint->tracepoints = Qnil;
 
   return Qnil;
 }
 
+static void
+index_breakpoint(VALUE breakpoint_object)
+{
+  breakpoint_t *breakpoint;
+  VALUE line;
+  VALUE bucket;
+
+  Data_Get_Struct(breakpoint_object, breakpoint_t, breakpoint);
+  line = INT2FIX(breakpoint->line);
+  bucket = rb_hash_lookup(breakpoints_index, line);
+  if (bucket == Qnil) {
+    bucket = rb_ary_new();
+    rb_hash_aset(breakpoints_index, line, bucket);
+  }
+  rb_ary_push(bucket, breakpoint_object);
+  indexed_count++;
+  if (breakpoint->tracepoints != Qnil)
+    targeted_count++;
+  if (breakpoint->log_message != Qnil)
+    logpoint_count++;
+}
+
+static void
+unindex_breakpoint(VALUE breakpoint_object)
+{
+  breakpoint_t *breakpoint;
+  VALUE line;
+  VALUE bucket;
+
+  Data_Get_Struct(breakpoint_object, breakpoint_t, breakpoint);
+  line = INT2FIX(breakpoint->line);
+  bucket = rb_hash_lookup(breakpoints_index, line);
+  if (bucket == Qnil) return;
+
+  rb_ary_delete(bucket, breakpoint_object);
+  if (RARRAY_LEN(bucket) == 0)
+    rb_hash_delete(breakpoints_index, line);
+  indexed_count--;
+  if (breakpoint->tracepoints != Qnil)
+    targeted_count--;
+  if (breakpoint->log_message != Qnil)
+    logpoint_count--;
+}
+
+static void
+rebuild_breakpoints_index(VALUE breakpoints)
+{
+  int i;
+
+  breakpoints_index = rb_hash_new();
+  indexed_breakpoints = breakpoints;
+  indexed_snapshot = rb_ary_dup(breakpoints);
+  invalidate_trace_points();
+  indexed_count = 0;
+  targeted_count = 0;
+  logpoint_count = 0;
+  for(i = 0; i < RARRAY_LENINT(breakpoints); i++)
+  {
+    index_breakpoint(rb_ary_entry(breakpoints, i));
+  }
+}
+
+/* compares the elements, breakpoints are few, so it is cheaper than a lookup */
+static inline int
+is_index_valid(VALUE breakpoints)
+{
+  long len;
+
+  if (breakpoints != indexed_breakpoints || breakpoints == Qnil) return 0;
+  len = RARRAY_LEN(breakpoints);
+  return len == RARRAY_LEN(indexed_snapshot) &&
+    memcmp(RARRAY_CONST_PTR(breakpoints), RARRAY_CONST_PTR(indexed_snapshot), len * sizeof(VALUE)) == 0;
+}
+
+static int
+match_file(breakpoint_t *breakpoint, debug_file_t *file)
+{
+  if(breakpoint->match_file_id != file->id || breakpoint->match_generation != file_table_generation)
+  {
+    breakpoint->match_file_id = file->id;
+    breakpoint->match_generation = file_table_generation;
+    breakpoint->match_result = filename_cmp_impl(breakpoint->source, file->realpath);
+  }
+  return breakpoint->match_result;
+}
+
+#ifdef DEBASE_TARGETED_TRACEPOINTS
+static VALUE
+enable_for_target(VALUE args)
+{
+  VALUE options;
+
+  options = RARRAY_AREF(args, 1);
+#ifdef RB_PASS_KEYWORDS
+  return rb_funcallv_kw(RARRAY_AREF(args, 0), idEnable, 1, &options, RB_PASS_KEYWORDS);
+#else
+  return rb_funcall(RARRAY_AREF(args, 0), idEnable, 1, options);
+#endif
+}
+
+/* Enables the tracepoint with TracePoint#enable options, returns 0 if it fails */
+extern int
+enable_targeted_tracepoint(VALUE tracepoint, VALUE options)
+{
+  int error;
+
+  rb_protect(enable_for_target, rb_ary_new3(2, tracepoint, options), &error);
+  if (error) rb_set_errinfo(Qnil);
+  return !error;
+}
+
+/* Enables line events only for the breakpoint line of the given iseq and its children.
+   Returns 0 if the iseq does not contain the line. */
+static int
+target_iseq(VALUE breakpoint_object, VALUE iseq)
+{
+  breakpoint_t *breakpoint;
+  VALUE tracepoint;
+  VALUE options;
+  int targeted;
+
+  Data_Get_Struct(breakpoint_object, breakpoint_t, breakpoint);
+  tracepoint = targeted_line_tracepoint_new();
+  options = rb_hash_new();
+  rb_hash_aset(options, ID2SYM(idTarget), iseq);
+  rb_hash_aset(options, ID2SYM(idTargetLine), INT2FIX(breakpoint->line));
+  if (!enable_targeted_tracepoint(tracepoint, options))
+    return 0;
+
+  targeted = breakpoint->tracepoints != Qnil;
+  if (!targeted)
+    breakpoint->tracepoints = rb_ary_new();
+  rb_ary_push(breakpoint->tracepoints, tracepoint);
+  /* callers pass only breakpoints from the indexed array */
+  if (!targeted && is_index_valid(indexed_breakpoints))
+    targeted_count++;
+  invalidate_trace_points();
+  return 1;
+}
+
+static void
+target_breakpoint(VALUE breakpoint_object)
+{
+  breakpoint_t *breakpoint;
+  debug_file_t *file;
+  VALUE iseq;
+  int i;
+
+  Data_Get_Struct(breakpoint_object, breakpoint_t, breakpoint);
+  for (i = 0; i < file_table_size(); i++) {
+    file = file_table_get(i);
+    iseq = file_table_iseq(file);
+    if (iseq != Qnil && match_file(breakpoint, file))
+      target_iseq(breakpoint_object, iseq);
+  }
+}
+
+static void
+untarget_breakpoint(VALUE breakpoint_object)
+{
+  breakpoint_t *breakpoint;
+  int i;
+
+  Data_Get_Struct(breakpoint_object, breakpoint_t, breakpoint);
+  if (breakpoint->tracepoints == Qnil) return;
+  for (i = 0; i < RARRAY_LENINT(breakpoint->tracepoints); i++)
+    rb_tracepoint_disable(rb_ary_entry(breakpoint->tracepoints, i));
+  breakpoint->tracepoints = Qnil;
+  invalidate_trace_points();
+}
+
+/* called for each compiled file, targets breakpoints which are set in it */
+extern void
+breakpoints_register_iseq(VALUE breakpoints, VALUE iseq)
+{
+  VALUE path;
+  VALUE breakpoint_object;
+  breakpoint_t *breakpoint;
+  debug_file_t *file;
+  int i;
+
+  path = rb_funcall(iseq, idPath, 0);
+  if (NIL_P(path)) return;
+  file = file_table_intern(path);
+  file_table_set_iseq(file, iseq);
+
+  if (breakpoints == Qnil) return;
+  if (!is_index_valid(breakpoints))
+    rebuild_breakpoints_index(breakpoints);
+  for (i = 0; i < RARRAY_LENINT(breakpoints); i++) {
+    breakpoint_object = rb_ary_entry(breakpoints, i);
+    Data_Get_Struct(breakpoint_object, breakpoint_t, breakpoint);
+    if (match_file(breakpoint, file))
+      target_iseq(breakpoint_object, iseq);
+  }
+}
+#else
+static void
+target_breakpoint(VALUE breakpoint_object)
+{
+}
+
+static void
+untarget_breakpoint(VALUE breakpoint_object)
+{
+}
+
+extern void
+breakpoints_register_iseq(VALUE breakpoints, VALUE iseq)
+{
+}
+#endif
+
+extern void
+breakpoints_disable_targets(VALUE breakpoints)
+{
+  int i;
+
+  if (breakpoints == Qnil) return;
+  for (i = 0; i < RARRAY_LENINT(breakpoints); i++)
+    untarget_breakpoint(rb_ary_entry(breakpoints, i));
+  indexed_breakpoints = Qnil;
+}
+
+/* line events are needed globally only for breakpoints without targeted tracepoints */
+extern int
+breakpoints_need_line_events(VALUE breakpoints)
+{
+  if (breakpoints == Qnil) return 0;
+  if (!is_index_valid(breakpoints))
+    rebuild_breakpoints_index(breakpoints);
+  return indexed_count > targeted_count;
+}
+
+static VALUE
+Breakpoint_add(VALUE self, VALUE breakpoints, VALUE breakpoint_object)
+{
+  int valid;
+
+  valid = is_index_valid(breakpoints);
+  rb_ary_push(breakpoints, breakpoint_object);
+  if (valid) {
+    rb_ary_push(indexed_snapshot, breakpoint_object);
+    index_breakpoint(breakpoint_object);
+  }
+  else
+    rebuild_breakpoints_index(breakpoints);
+  target_breakpoint(breakpoint_object);
+  invalidate_trace_points();
+  return breakpoint_object;
+}
+
 static VALUE
 Breakpoint_remove(VALUE self, VALUE breakpoints, VALUE id_value)
 {
   int i;
   int id;
+  int valid;
   VALUE breakpoint_object;
   breakpoint_t *breakpoint;
 
@@ -97,7 +722,14 @@ Breakpoint_remove(VALUE self, VALUE breakpoints, VALUE id_value)
     Data_Get_Struct(breakpoint_object, breakpoint_t, breakpoint);
     if(breakpoint->id == id)
     {
+      valid = is_index_valid(breakpoints);
       rb_ary_delete_at(breakpoints, i);
+      if (valid) {
+        rb_ary_delete_at(indexed_snapshot, i);
+        unindex_breakpoint(breakpoint_object);
+      }
+      untarget_breakpoint(breakpoint_object);
+      invalidate_trace_points();
       return breakpoint_object;
     }
   }
@@ -137,10 +769,20 @@ Breakpoint_expr_set(VALUE self, VALUE new_val)
   breakpoint_t *breakpoint;
 
   Data_Get_Struct(self, breakpoint_t, breakpoint);
-  breakpoint->expr = new_val;
+  breakpoint->expr = NIL_P(new_val) ? new_val : StringValue(new_val);
+  check_expr_syntax(&breakpoint->compiled_expr, breakpoint->expr);
   return breakpoint->expr;
 }
 
+static VALUE
+Breakpoint_expr_error(VALUE self)
+{
+  breakpoint_t *breakpoint;
+
+  Data_Get_Struct(self, breakpoint_t, breakpoint);
+  return breakpoint->compiled_expr.error;
+}
+
 static VALUE
 Breakpoint_enabled_set(VALUE self, VALUE new_val)
 {
@@ -151,6 +793,229 @@ Breakpoint_enabled_set(VALUE self, VALUE new_val)
   return breakpoint->enabled;
 }
 
+/*
+ *  call-seq:
+ *    breakpoint.hit_count -> int
+ *
+ *  Returns the number of times the breakpoint was reached.
+ */
+static VALUE
+Breakpoint_hit_count(VALUE self)
+{
+  breakpoint_t *breakpoint;
+
+  Data_Get_Struct(self, breakpoint_t, breakpoint);
+  return INT2FIX(breakpoint->hit_count);
+}
+
+/*
+ *  call-seq:
+ *    breakpoint.hit_value -> int
+ *
+ *  Returns the value used by the hit condition.
+ */
+static VALUE
+Breakpoint_hit_value(VALUE self)
+{
+  breakpoint_t *breakpoint;
+
+  Data_Get_Struct(self, breakpoint_t, breakpoint);
+  return INT2FIX(breakpoint->hit_value);
+}
+
+/*
+ *  call-seq:
+ *    breakpoint.hit_value = int
+ *
+ *  Sets the value used by the hit condition.
+ */
+static VALUE
+Breakpoint_hit_value_set(VALUE self, VALUE value)
+{
+  breakpoint_t *breakpoint;
+
+  Data_Get_Struct(self, breakpoint_t, breakpoint);
+  breakpoint->hit_value = NUM2INT(value);
+  return value;
+}
+
+/*
+ *  call-seq:
+ *    breakpoint.hit_condition -> symbol
+ *
+ *  Returns the hit condition: nil, :greater_or_equal, :equal or :modulo.
+ */
+static VALUE
+Breakpoint_hit_condition(VALUE self)
+{
+  breakpoint_t *breakpoint;
+
+  Data_Get_Struct(self, breakpoint_t, breakpoint);
+  switch (breakpoint->hit_condition) {
+    case HIT_COND_GE:
+      return ID2SYM(idHitGE);
+    case HIT_COND_EQ:
+      return ID2SYM(idHitEQ);
+    case HIT_COND_MOD:
+      return ID2SYM(idHitMod);
+    default:
+      return Qnil;
+  }
+}
+
+/*
+ *  call-seq:
+ *    breakpoint.hit_condition = symbol
+ *
+ *  Sets the hit condition: nil, :greater_or_equal, :equal or :modulo.
+ *  The breakpoint stops when its hit count is greater or equal to,
+ *  equal to or a multiple of hit_value.
+ */
+static VALUE
+Breakpoint_hit_condition_set(VALUE self, VALUE value)
+{
+  breakpoint_t *breakpoint;
+  ID id_value;
+
+  Data_Get_Struct(self, breakpoint_t, breakpoint);
+  if (NIL_P(value)) {
+    breakpoint->hit_condition = HIT_COND_NONE;
+    return value;
+  }
+  id_value = rb_to_id(value);
+  if (id_value == idHitGE)
+    breakpoint->hit_condition = HIT_COND_GE;
+  else if (id_value == idHitEQ)
+    breakpoint->hit_condition = HIT_COND_EQ;
+  else if (id_value == idHitMod)
+    breakpoint->hit_condition = HIT_COND_MOD;
+  else
+    rb_raise(rb_eArgError, "Invalid condition parameter");
+  return value;
+}
+
+/*
+ *  call-seq:
+ *    breakpoint.thread -> thread
+ *
+ *  Returns the only thread stopped by the breakpoint, nil means all threads.
+ */
+static VALUE
+Breakpoint_thread(VALUE self)
+{
+  breakpoint_t *breakpoint;
+
+  Data_Get_Struct(self, breakpoint_t, breakpoint);
+  return breakpoint->thread;
+}
+
+/*
+ *  call-seq:
+ *    breakpoint.thread = thread
+ *
+ *  Makes the breakpoint stop only the given thread.
+ */
+static VALUE
+Breakpoint_thread_set(VALUE self, VALUE thread)
+{
+  breakpoint_t *breakpoint;
+
+  Data_Get_Struct(self, breakpoint_t, breakpoint);
+  if (!NIL_P(thread) && !rb_obj_is_kind_of(thread, rb_cThread))
+    rb_raise(rb_eTypeError, "Thread expected");
+  breakpoint->thread = thread;
+  return thread;
+}
+
+/* Converts a message template into a Ruby string expression,
+   "x = {x}" becomes "x = " "#{(x\n)}" */
+static VALUE
+log_message_to_expr(VALUE message)
+{
+  VALUE expr;
+  const char *ptr, *start, *end;
+  int depth;
+
+  expr = rb_str_new2("\"\"");
+  start = ptr = RSTRING_PTR(message);
+  end = ptr + RSTRING_LEN(message);
+  while (ptr < end) {
+    if (*ptr != '{') {
+      ptr++;
+      continue;
+    }
+    if (ptr > start) {
+      rb_str_cat2(expr, " ");
+      rb_str_append(expr, rb_str_dump(rb_str_new(start, ptr - start)));
+    }
+    start = ++ptr;
+    for (depth = 1; ptr < end; ptr++) {
+      if (*ptr == '{') depth++;
+      if (*ptr == '}' && --depth == 0) break;
+    }
+    /* an unclosed brace is kept as text */
+    if (ptr == end) {
+      start--;
+      break;
+    }
+    rb_str_cat2(expr, " \"#{(");
+    rb_str_cat(expr, start, ptr - start);
+    rb_str_cat2(expr, "\n)}\"");
+    start = ++ptr;
+  }
+  if (end > start) {
+    rb_str_cat2(expr, " ");
+    rb_str_append(expr, rb_str_dump(rb_str_new(start, end - start)));
+  }
+  return expr;
+}
+
+/*
+ *  call-seq:
+ *    breakpoint.log_message -> string
+ *
+ *  Returns the message template of a logpoint, nil for breakpoints.
+ */
+static VALUE
+Breakpoint_log_message(VALUE self)
+{
+  breakpoint_t *breakpoint;
+
+  Data_Get_Struct(self, breakpoint_t, breakpoint);
+  return breakpoint->log_message;
+}
+
+/*
+ *  call-seq:
+ *    breakpoint.log_message = string
+ *
+ *  Turns the breakpoint into a logpoint. Instead of stopping, the message is
+ *  rendered with {expression} parts evaluated in the frame and buffered,
+ *  see Debase.flush_logpoints. Setting nil turns it back into a breakpoint.
+ */
+static VALUE
+Breakpoint_log_message_set(VALUE self, VALUE message)
+{
+  breakpoint_t *breakpoint;
+
+  Data_Get_Struct(self, breakpoint_t, breakpoint);
+  breakpoint->log_message = NIL_P(message) ? message : rb_str_new_frozen(StringValue(message));
+  breakpoint->log_expr = NIL_P(message) ? Qnil : log_message_to_expr(message);
+  check_expr_syntax(&breakpoint->compiled_log, breakpoint->log_expr);
+  /* logpoints are counted by the index */
+  indexed_breakpoints = Qnil;
+  return message;
+}
+
+static VALUE
+Breakpoint_log_error(VALUE self)
+{
+  breakpoint_t *breakpoint;
+
+  Data_Get_Struct(self, breakpoint_t, breakpoint);
+  return breakpoint->compiled_log.error;
+}
+
 static VALUE
 Breakpoint_enabled_get(VALUE self)
 {
@@ -160,6 +1025,15 @@ Breakpoint_enabled_get(VALUE self)
   return breakpoint->enabled;
 }
 
+static VALUE
+Breakpoint_targeted(VALUE self)
+{
+  breakpoint_t *breakpoint;
+
+  Data_Get_Struct(self, breakpoint_t, breakpoint);
+  return breakpoint->tracepoints != Qnil ? Qtrue : Qfalse;
+}
+
 static VALUE
 Breakpoint_pos(VALUE self)
 {
@@ -200,29 +1074,8 @@ filename_cmp_impl(VALUE source, char *file)
   return 1;
 }
 
-int
-filename_cmp(VALUE source, char *file)
-{
-#ifdef _WIN32
-  return filename_cmp_impl(source, file);
-#else
-#ifdef PATH_MAX
-  char path[PATH_MAX + 1];    
-  path[PATH_MAX] = 0;
-  return filename_cmp_impl(source, realpath(file, path) != NULL ? path : file);
-#else
-  char *path;
-  int result;
-  path = realpath(file, NULL);
-  result = filename_cmp_impl(source, path == NULL ? file : path);
-  free(path);
-  return result;
-#endif  
-#endif  
-}
-
 static int
-check_breakpoint_by_pos(VALUE breakpoint_object, char *file, int line)
+check_breakpoint_by_pos(VALUE breakpoint_object, debug_file_t *file, int line)
 {
     breakpoint_t *breakpoint;
 
@@ -232,16 +1085,74 @@ check_breakpoint_by_pos(VALUE breakpoint_object, char *file, int line)
     if (Qtrue != breakpoint->enabled) return 0;
     if(breakpoint->line != line)
         return 0;
-    if(filename_cmp(breakpoint->source, file))
-        return 1;
-    return 0;
+    return match_file(breakpoint, file);
+}
+
+static inline int
+is_logpoint(VALUE breakpoint_object)
+{
+  breakpoint_t *breakpoint;
+
+  Data_Get_Struct(breakpoint_object, breakpoint_t, breakpoint);
+  return breakpoint->log_message != Qnil;
+}
+
+/* thread filter and hit conditions are checked before the expression */
+static int
+check_breakpoint_hit_condition(VALUE breakpoint_object)
+{
+  breakpoint_t *breakpoint;
+
+  Data_Get_Struct(breakpoint_object, breakpoint_t, breakpoint);
+  if (breakpoint->thread != Qnil && breakpoint->thread != rb_thread_current()) return 0;
+
+  breakpoint->hit_count++;
+  switch (breakpoint->hit_condition) {
+    case HIT_COND_NONE:
+      return 1;
+    case HIT_COND_GE:
+      return breakpoint->hit_count >= breakpoint->hit_value;
+    case HIT_COND_EQ:
+      return breakpoint->hit_count == breakpoint->hit_value;
+    case HIT_COND_MOD:
+      return breakpoint->hit_value > 0 && breakpoint->hit_count % breakpoint->hit_value == 0;
+  }
+  return 0;
+}
+
+static VALUE
+trace_point_binding(VALUE trace_point)
+{
+  if (NIL_P(trace_point)) return toplevel_binding;
+  return rb_tracearg_binding(rb_tracearg_from_tracepoint(trace_point));
+}
+
+/* The class constants of the frame are resolved in. Methods of a singleton
+   class resolve constants in the class or module they are defined on. */
+static VALUE
+trace_point_class(VALUE trace_point)
+{
+  rb_trace_arg_t *trace_arg;
+  VALUE klass;
+  VALUE self;
+
+  if (NIL_P(trace_point)) return rb_cObject;
+  trace_arg = rb_tracearg_from_tracepoint(trace_point);
+  klass = rb_tracearg_defined_class(trace_arg);
+  if (NIL_P(klass)) return rb_cObject;
+  if (FL_TEST(klass, FL_SINGLETON)) {
+    self = rb_tracearg_self(trace_arg);
+    return RB_TYPE_P(self, T_CLASS) || RB_TYPE_P(self, T_MODULE) ? self : rb_cObject;
+  }
+  return klass;
 }
 
 static int
 check_breakpoint_expr(VALUE breakpoint_object, VALUE trace_point)
 {
   breakpoint_t *breakpoint;
-  VALUE binding, args, result;
+  VALUE result;
+  stats_timer_t timer;
   int error;
 
   if(breakpoint_object == Qnil) return 0;
@@ -249,37 +1160,125 @@ check_breakpoint_expr(VALUE breakpoint_object, VALUE trace_point)
   if (Qtrue != breakpoint->enabled) return 0;
   if (NIL_P(breakpoint->expr)) return 1;
 
-  if (NIL_P(trace_point)) {
-    binding = rb_const_get(rb_cObject, rb_intern("TOPLEVEL_BINDING"));
-  } else {
-    binding = rb_tracearg_binding(rb_tracearg_from_tracepoint(trace_point));
-  }
+  /* a compile error is reported once, the breakpoint never stops after that */
+  if (breakpoint->compiled_expr.error != Qnil) return 0;
 
-  args = rb_ary_new3(2, breakpoint->expr, binding);
-  result = rb_protect(eval_expression, args, &error);
+  stats_start(&timer);
+  result = eval_compiled_expr(&breakpoint->compiled_expr, breakpoint->expr, trace_point_binding(trace_point),
+    trace_point_class(trace_point), &error);
+  stats_record(STAT_CONDITION_EVAL, &timer);
   return !error && RTEST(result);
 }
 
+static void
+emit_logpoint(breakpoint_t *breakpoint, VALUE trace_point)
+{
+  VALUE message;
+  int error;
+
+  message = eval_compiled_expr(&breakpoint->compiled_log, breakpoint->log_expr, trace_point_binding(trace_point),
+    trace_point_class(trace_point), &error);
+  log_buffer_push(error || !RB_TYPE_P(message, T_STRING) ? breakpoint->log_message : message);
+}
+
+extern int
+breakpoints_have_logpoints(VALUE breakpoints)
+{
+  if (breakpoints == Qnil || RARRAY_LEN(breakpoints) == 0) return 0;
+  if (!is_index_valid(breakpoints))
+    rebuild_breakpoints_index(breakpoints);
+  return logpoint_count > 0;
+}
+
+/* Buffers messages of the logpoints set on this line.
+   Returns 1 if a message was emitted and no breakpoint can stop on the line. */
+extern int
+breakpoints_emit_logpoints(VALUE breakpoints, debug_file_t *file, int line, VALUE trace_point)
+{
+  VALUE breakpoint_object;
+  VALUE bucket;
+  breakpoint_t *breakpoint;
+  int emitted;
+  int can_stop;
+  int i;
+
+  if (!breakpoints_have_logpoints(breakpoints)) return 0;
+  bucket = rb_hash_lookup(breakpoints_index, INT2FIX(line));
+  if (bucket == Qnil) return 0;
+
+  emitted = 0;
+  can_stop = 0;
+  for(i = 0; i < RARRAY_LENINT(bucket); i++)
+  {
+    breakpoint_object = rb_ary_entry(bucket, i);
+    if (!check_breakpoint_by_pos(breakpoint_object, file, line)) continue;
+    Data_Get_Struct(breakpoint_object, breakpoint_t, breakpoint);
+    if (breakpoint->log_message == Qnil) {
+      can_stop = 1;
+      continue;
+    }
+    if (check_breakpoint_hit_condition(breakpoint_object) &&
+      check_breakpoint_expr(breakpoint_object, trace_point))
+    {
+      emit_logpoint(breakpoint, trace_point);
+      emitted = 1;
+    }
+  }
+  return emitted && !can_stop;
+}
+
 static VALUE
 Breakpoint_find(VALUE self, VALUE breakpoints, VALUE source, VALUE pos, VALUE trace_point)
 {
-  return breakpoint_find(breakpoints, source, pos, trace_point);
+  return breakpoint_find(breakpoints, file_table_intern(StringValue(source)), FIX2INT(pos), trace_point);
 }
 
+/* Returns the line tracepoints of the first targeted breakpoint at the line,
+   or Qnil. Breakpoints on the same line target the same iseqs, only these
+   tracepoints process the event, so it is not handled once per breakpoint. */
 extern VALUE
-breakpoint_find(VALUE breakpoints, VALUE source, VALUE pos, VALUE trace_point)
+breakpoints_line_tracepoints(VALUE breakpoints, debug_file_t *file, int line)
+{
+  VALUE bucket;
+  breakpoint_t *breakpoint;
+  int i;
+
+  if (RARRAY_LEN(breakpoints) == 0 || targeted_count == 0) return Qnil;
+  if (!is_index_valid(breakpoints))
+    rebuild_breakpoints_index(breakpoints);
+  bucket = rb_hash_lookup(breakpoints_index, INT2FIX(line));
+  if (bucket == Qnil) return Qnil;
+
+  for(i = 0; i < RARRAY_LENINT(bucket); i++)
+  {
+    Data_Get_Struct(rb_ary_entry(bucket, i), breakpoint_t, breakpoint);
+    if (breakpoint->tracepoints != Qnil && breakpoint->line == line && match_file(breakpoint, file))
+      return breakpoint->tracepoints;
+  }
+  return Qnil;
+}
+
+extern VALUE
+breakpoint_find(VALUE breakpoints, debug_file_t *file, int line, VALUE trace_point)
 {
   VALUE breakpoint_object;
-  char *file;
-  int line;
+  VALUE bucket;
   int i;
 
-  file = RSTRING_PTR(source);
-  line = FIX2INT(pos);
-  for(i = 0; i < RARRAY_LENINT(breakpoints); i++)
+  if (RARRAY_LEN(breakpoints) == 0) return Qnil;
+  if (!is_index_valid(breakpoints))
+    rebuild_breakpoints_index(breakpoints);
+
+  /* only breakpoints set on this line have to be compared by file name */
+  bucket = rb_hash_lookup(breakpoints_index, INT2FIX(line));
+  if (bucket == Qnil) return Qnil;
+
+  for(i = 0; i < RARRAY_LENINT(bucket); i++)
   {
-    breakpoint_object = rb_ary_entry(breakpoints, i);
+    breakpoint_object = rb_ary_entry(bucket, i);
     if (check_breakpoint_by_pos(breakpoint_object, file, line) &&
+      !is_logpoint(breakpoint_object) &&
+      check_breakpoint_hit_condition(breakpoint_object) &&
       check_breakpoint_expr(breakpoint_object, trace_point))
     {
       return breakpoint_object;
@@ -292,6 +1291,15 @@ extern void
 breakpoint_init_variables()
 {
   breakpoint_max = 0;
+  breakpoints_index = Qnil;
+  indexed_breakpoints = Qnil;
+  indexed_snapshot = Qnil;
+  indexed_count = 0;
+  targeted_count = 0;
+  logpoint_count = 0;
+  catchpoint_cache = Qnil;
+  cached_catchpoints = Qnil;
+  catchpoint_options = rb_hash_new();
 }
 
 extern void
@@ -300,20 +1308,61 @@ Init_breakpoint(VALUE mDebase)
   breakpoint_init_variables();
   cBreakpoint = rb_define_class_under(mDebase, "Breakpoint", rb_cObject);
   rb_define_singleton_method(cBreakpoint, "find", Breakpoint_find, 4);
+  rb_define_singleton_method(cBreakpoint, "add", Breakpoint_add, 2);
   rb_define_singleton_method(cBreakpoint, "remove", Breakpoint_remove, 2);
   rb_define_method(cBreakpoint, "initialize", Breakpoint_initialize, 3);
   rb_define_method(cBreakpoint, "id", Breakpoint_id, 0);
   rb_define_method(cBreakpoint, "source", Breakpoint_source, 0);
   rb_define_method(cBreakpoint, "pos", Breakpoint_pos, 0);
+  rb_define_method(cBreakpoint, "targeted?", Breakpoint_targeted, 0);
+  rb_define_method(cBreakpoint, "hit_count", Breakpoint_hit_count, 0);
+  rb_define_method(cBreakpoint, "hit_value", Breakpoint_hit_value, 0);
+  rb_define_method(cBreakpoint, "hit_value=", Breakpoint_hit_value_set, 1);
+  rb_define_method(cBreakpoint, "hit_condition", Breakpoint_hit_condition, 0);
+  rb_define_method(cBreakpoint, "hit_condition=", Breakpoint_hit_condition_set, 1);
+  rb_define_method(cBreakpoint, "thread", Breakpoint_thread, 0);
+  rb_define_method(cBreakpoint, "thread=", Breakpoint_thread_set, 1);
+  rb_define_method(cBreakpoint, "log_message", Breakpoint_log_message, 0);
+  rb_define_method(cBreakpoint, "log_message=", Breakpoint_log_message_set, 1);
+  rb_define_method(cBreakpoint, "log_error", Breakpoint_log_error, 0);
 
   /* <For tests> */
   rb_define_method(cBreakpoint, "expr", Breakpoint_expr_get, 0);
   rb_define_method(cBreakpoint, "expr=", Breakpoint_expr_set, 1);
+  rb_define_method(cBreakpoint, "expr_error", Breakpoint_expr_error, 0);
   rb_define_method(cBreakpoint, "enabled", Breakpoint_enabled_get, 0);
   rb_define_method(cBreakpoint, "enabled=", Breakpoint_enabled_set, 1);
   /* </For tests> */
 
   rb_define_alloc_func(cBreakpoint, Breakpoint_create);
 
+  rb_define_module_function(mDebase, "invalidate_catchpoints", Debase_invalidate_catchpoints, 0);
+  rb_define_module_function(mDebase, "set_catchpoint_options", Debase_set_catchpoint_options, 3);
+
   idEval = rb_intern("eval");
+  idMesg = rb_intern("mesg");
+  idMessage = rb_intern("message");
+  idCompareByIdentity = rb_intern("compare_by_identity");
+  idInstanceExec = rb_intern("instance_exec");
+  idModuleEval = rb_intern("module_eval");
+  idReceiver = rb_intern("receiver");
+  idLocalVariables = rb_intern("local_variables");
+  idHitGE = rb_intern("greater_or_equal");
+  idHitEQ = rb_intern("equal");
+  idHitMod = rb_intern("modulo");
+  toplevel_binding = rb_const_get(rb_cObject, rb_intern("TOPLEVEL_BINDING"));
+#ifdef DEBASE_TARGETED_TRACEPOINTS
+  idEnable = rb_intern("enable");
+  idPath = rb_intern("path");
+  idTarget = rb_intern("target");
+  idTargetLine = rb_intern("target_line");
+#endif
+
+  rb_global_variable(&toplevel_binding);
+  rb_global_variable(&catchpoint_cache);
+  rb_global_variable(&cached_catchpoints);
+  rb_global_variable(&catchpoint_options);
+  rb_global_variable(&breakpoints_index);
+  rb_global_variable(&indexed_breakpoints);
+  rb_global_variable(&indexed_snapshot);
 }
@@ -3,7 +3,14 @@
 static VALUE cContext;
 static int thnum_current = 0;
 
-static VALUE idAlive;
+#ifdef DEBASE_TARGETED_TRACEPOINTS
+typedef struct rb_iseq_struct rb_iseq_t;
+extern VALUE rb_iseqw_new(const rb_iseq_t *iseq);
+#endif
+
+static ID idPath;
+static ID idLineno;
+static ID idBaseLabel;
 
 /* "Step", "Next" and "Finish" do their work by saving information
    about where to stop next. reset_stopping_points removes/resets this
@@ -14,6 +21,23 @@ reset_stepping_stop_points(debug_context_t *context)
   context->dest_frame = -1;
   context->stop_line  = -1;
   context->stop_next  = -1;
+  set_step_target(context, Qnil, 0);
+}
+
+/* Returns the iseq of a frame as RubyVM::InstructionSequence, or nil
+   when frames can't be inspected. Valid only while the context is stopped. */
+extern VALUE
+frame_iseq(debug_context_t *context, int index)
+{
+#ifdef DEBASE_TARGETED_TRACEPOINTS
+  VALUE iseq;
+
+  if (context->inspector == NULL || index < 0 || index >= context->stack_size) return Qnil;
+  iseq = rb_debug_inspector_frame_iseq_get(context->inspector, context->frames[index].index);
+  return iseq == Qnil ? Qnil : rb_iseqw_new((const rb_iseq_t *)iseq);
+#else
+  return Qnil;
+#endif
 }
 
 static inline VALUE
@@ -23,65 +47,52 @@ Context_thnum(VALUE self) {
   return INT2FIX(context->thnum);
 }
 
-static inline void
-fill_frame(debug_frame_t *frame, const char* file, int line, VALUE binding, VALUE self)
-{ 
-  frame->file = file;
-  frame->line = line;
-  frame->binding = binding;
-  frame->self = self;
-}
-
-extern void 
+extern void
 fill_stack(debug_context_t *context, const rb_debug_inspector_t *inspector) {
   debug_frame_t *frame;
   VALUE locations;
-  VALUE location;
-  VALUE path;
-  VALUE lineno;
-  const char *file;
-  int line;
   int stack_size;
   int i;
 
   locations = rb_debug_inspector_backtrace_locations(inspector);
   stack_size = locations == Qnil ? 0 : RARRAY_LENINT(locations);
   context->stack_size = 0;
-  
+  context->locations = locations;
+  context->inspector = inspector;
+
+  if (stack_size > context->frames_capacity) {
+    context->frames_capacity = stack_size;
+    REALLOC_N(context->frames, debug_frame_t, context->frames_capacity);
+  }
+
   for (i = 0; i < stack_size; i++) {
-    
-    location = rb_ary_entry(locations, i);
-    VALUE iseq = rb_debug_inspector_frame_iseq_get(inspector, i);
-      
-    if(iseq != Qnil)
-    {
-      frame = ALLOC(debug_frame_t);
-      path = rb_funcall(location, rb_intern("path"), 0);
-      lineno = rb_funcall(location, rb_intern("lineno"), 0);
-      file = path != Qnil ? RSTRING_PTR(path) : "";
-      line = FIX2INT(lineno);
-      
-      fill_frame(frame, file, line, rb_debug_inspector_frame_binding_get(inspector, i), rb_debug_inspector_frame_self_get(inspector, i));
-      frame->prev = context->stack;
-      context->stack = frame;
-      context->stack_size++;
-    }
+    if (rb_debug_inspector_frame_iseq_get(inspector, i) == Qnil) continue;
+
+    /* the inspector has already created bindings of all frames, they are
+       captured so handlers can use them after the inspector is closed */
+    frame = &context->frames[context->stack_size++];
+    frame->index = i;
+    frame->line = -1;
+    frame->path = Qundef;
+    frame->binding = rb_debug_inspector_frame_binding_get(inspector, i);
+    frame->self = rb_debug_inspector_frame_self_get(inspector, i);
+    frame->klass = rb_debug_inspector_frame_class_get(inspector, i);
   }
 }
 
+/* called when the inspector is closed, frame iseqs can't be read after that */
 extern void
-clear_stack(debug_context_t *context)
-{  
-  debug_frame_t *frame;
-  debug_frame_t *prev;
+release_inspector(debug_context_t *context)
+{
+  context->inspector = NULL;
+}
 
-  frame = context->stack;
-  while(frame != NULL) {
-    prev = frame->prev;
-    xfree(frame);
-    frame = prev;
-  }
-  context->stack = NULL;
+extern void
+clear_stack(debug_context_t *context)
+{
+  context->stack_size = 0;
+  context->locations = Qnil;
+  context->inspector = NULL;
 }
 
 static inline VALUE 
@@ -108,6 +119,15 @@ Context_dead(VALUE self)
   return IS_THREAD_ALIVE(context->thread) ? Qfalse : Qtrue;
 }
 
+/* a thread is stopped while the debugger handles its stop */
+static inline VALUE 
+Context_stopped(VALUE self) 
+{
+  debug_context_t *context;
+  Data_Get_Struct(self, debug_context_t, context);
+  return context->stop_reason != CTX_STOP_NONE ? Qtrue : Qfalse;
+}
+
 extern VALUE 
 Context_ignored(VALUE self) 
 {
@@ -122,19 +142,26 @@ static void
 Context_mark(debug_context_t *context) 
 {
   debug_frame_t *frame;
+  int i;
 
   rb_gc_mark(context->thread);
-  frame = context->stack;
-  while(frame != NULL)
+  rb_gc_mark(context->locations);
+  rb_gc_mark(context->step_iseq);
+  rb_gc_mark(context->step_line_tp);
+  rb_gc_mark(context->step_return_tp);
+  for (i = 0; i < context->stack_size; i++)
   {
+    frame = &context->frames[i];
+    rb_gc_mark(frame->path);
     rb_gc_mark(frame->self);
     rb_gc_mark(frame->binding);
-    frame = frame->prev;
+    rb_gc_mark(frame->klass);
   }
 }
 
 static void
 Context_free(debug_context_t *context) {
+  xfree(context->frames);
   xfree(context);
 }
 
@@ -149,17 +176,24 @@ context_create(VALUE thread, VALUE cDebugThread) {
   context->calced_stack_size = locations != Qnil ? RARRAY_LENINT(locations) : 0;
   context->init_stack_size = -1;
 
-  context->stack = NULL;
+  context->frames = NULL;
+  context->frames_capacity = 0;
+  context->locations = Qnil;
+  context->inspector = NULL;
   context->thnum = ++thnum_current;
   context->thread = thread;
   context->flags = 0;
-  context->last_file = NULL;
+  context->last_file_id = -1;
   context->last_line = -1;
   context->hit_user_code = 0;
   context->script_finished = 0;
   context->stop_frame = -1;
   context->thread_pause = 0;
+  context->stopped_ns = 0;
   context->stop_reason = CTX_STOP_NONE;
+  context->step_iseq = Qnil;
+  context->step_line_tp = Qnil;
+  context->step_return_tp = Qnil;
   reset_stepping_stop_points(context);
   if(rb_obj_class(thread) == cDebugThread) CTX_FL_SET(context, CTX_FL_IGNORE);
   return Data_Wrap_Struct(cContext, Context_mark, Context_free, context);
@@ -174,18 +208,67 @@ check_frame_number_valid(debug_context_t *context, int frame_no)
   }
 }
 
-static debug_frame_t*
+static inline debug_frame_t*
 get_frame_no(debug_context_t *context, int frame_no)
 {
-  debug_frame_t *frame;
-  int i;
-
   check_frame_number_valid(context, frame_no);
-  frame = context->stack;
-  for (i = 0; i < context->stack_size - frame_no - 1; i++) {
-    frame = frame->prev;
-  }
-  return frame;
+  return &context->frames[frame_no];
+}
+
+static inline VALUE
+frame_location(debug_context_t *context, debug_frame_t *frame)
+{
+  return rb_ary_entry(context->locations, frame->index);
+}
+
+/* the cached path of the frame, nil if unknown */
+extern VALUE
+frame_path(debug_context_t *context, debug_frame_t *frame)
+{
+  if (frame->path == Qundef)
+    frame->path = rb_funcall(frame_location(context, frame), idPath, 0);
+  return frame->path;
+}
+
+static VALUE
+frame_file(debug_context_t *context, debug_frame_t *frame)
+{
+  VALUE path;
+
+  path = frame_path(context, frame);
+  return path == Qnil ? rb_str_new2("") : rb_str_dup(path);
+}
+
+extern int
+frame_line(debug_context_t *context, debug_frame_t *frame)
+{
+  if (frame->line < 0)
+    frame->line = FIX2INT(rb_funcall(frame_location(context, frame), idLineno, 0));
+  return frame->line;
+}
+
+extern VALUE
+frame_label(debug_context_t *context, debug_frame_t *frame)
+{
+  return rb_funcall(frame_location(context, frame), idBaseLabel, 0);
+}
+
+extern VALUE
+frame_class(debug_context_t *context, debug_frame_t *frame)
+{
+  return frame->klass;
+}
+
+extern VALUE
+frame_binding(debug_context_t *context, debug_frame_t *frame)
+{
+  return frame->binding;
+}
+
+extern VALUE
+frame_self(debug_context_t *context, debug_frame_t *frame)
+{
+  return frame->self;
 }
 
 static VALUE
@@ -199,7 +282,7 @@ Context_frame_file(int argc, VALUE *argv, VALUE self)
   Data_Get_Struct(self, debug_context_t, context);
   frame_n = rb_scan_args(argc, argv, "01", &frame_no) == 0 ? 0 : FIX2INT(frame_no);
   frame = get_frame_no(context, frame_n);
-  return rb_str_new2(frame->file);
+  return frame_file(context, frame);
 }
 
 static VALUE
@@ -213,7 +296,7 @@ Context_frame_line(int argc, VALUE *argv, VALUE self)
   Data_Get_Struct(self, debug_context_t, context);
   frame_n = rb_scan_args(argc, argv, "01", &frame_no) == 0 ? 0 : FIX2INT(frame_no);
   frame = get_frame_no(context, frame_n);
-  return INT2FIX(frame->line);
+  return INT2FIX(frame_line(context, frame));
 }
 
 static VALUE
@@ -227,7 +310,7 @@ Context_frame_binding(int argc, VALUE *argv, VALUE self)
   Data_Get_Struct(self, debug_context_t, context);
   frame_n = rb_scan_args(argc, argv, "01", &frame_no) == 0 ? 0 : FIX2INT(frame_no);
   frame = get_frame_no(context, frame_n);
-  return frame->binding;
+  return frame_binding(context, frame);
 }
 
 static VALUE
@@ -241,36 +324,75 @@ Context_frame_self(int argc, VALUE *argv, VALUE self)
   Data_Get_Struct(self, debug_context_t, context);
   frame_n = rb_scan_args(argc, argv, "01", &frame_no) == 0 ? 0 : FIX2INT(frame_no);
   frame = get_frame_no(context, frame_n);
-  return frame->self;
+  return frame_self(context, frame);
 }
 
+/*
+ *  call-seq:
+ *    context.frames(from = 0, count = stack_size - from) -> array
+ *
+ *  Returns [file, line, method, class] of each frame in the given window,
+ *  only these frames are read.
+ */
 static VALUE
-Context_stop_reason(VALUE self)
+Context_frames(int argc, VALUE *argv, VALUE self)
 {
-    debug_context_t *context;
-    const char *symbol;
+  debug_context_t *context;
+  debug_frame_t *frame;
+  VALUE from_value, count_value;
+  VALUE result;
+  int from, to;
+  int i;
+
+  Data_Get_Struct(self, debug_context_t, context);
+  rb_scan_args(argc, argv, "02", &from_value, &count_value);
+  from = NIL_P(from_value) ? 0 : FIX2INT(from_value);
+  if (from < 0 || from > context->stack_size) {
+    rb_raise(rb_eArgError, "Invalid frame number %d, stack (0...%d)",
+        from, context->stack_size);
+  }
+  to = NIL_P(count_value) ? context->stack_size : from + FIX2INT(count_value);
+  if (to > context->stack_size) to = context->stack_size;
+
+  result = rb_ary_new2(to > from ? to - from : 0);
+  for (i = from; i < to; i++) {
+    frame = &context->frames[i];
+    rb_ary_push(result, rb_ary_new3(4,
+      frame_file(context, frame),
+      INT2FIX(frame_line(context, frame)),
+      frame_label(context, frame),
+      frame_class(context, frame)));
+  }
+  return result;
+}
+
+extern const char *
+stop_reason_name(debug_context_t *context)
+{
+    if(CTX_FL_TEST(context, CTX_FL_DEAD))
+        return "post-mortem";
 
-    Data_Get_Struct(self, debug_context_t, context);
-    
     switch(context->stop_reason)
     {
         case CTX_STOP_STEP:
-            symbol = "step";
-            break;
+            return "step";
         case CTX_STOP_BREAKPOINT:
-            symbol = "breakpoint";
-            break;
+            return "breakpoint";
         case CTX_STOP_CATCHPOINT:
-            symbol = "catchpoint";
-            break;
+            return "catchpoint";
         case CTX_STOP_NONE:
         default:
-            symbol = "none";
+            return "none";
     }
-    if(CTX_FL_TEST(context, CTX_FL_DEAD))
-        symbol = "post-mortem";
-    
-    return ID2SYM(rb_intern(symbol));
+}
+
+static VALUE
+Context_stop_reason(VALUE self)
+{
+    debug_context_t *context;
+
+    Data_Get_Struct(self, debug_context_t, context);
+    return ID2SYM(rb_intern(stop_reason_name(context)));
 }
 
 static VALUE
@@ -285,8 +407,8 @@ Context_pause(VALUE self)
     return Qfalse;
   }
 
-  enable_trace_points();
   context->thread_pause = 1;
+  update_trace_points();
   return Qtrue;
 }
 
@@ -309,6 +431,7 @@ Context_stop_next(int argc, VALUE *argv, VALUE self)
       CTX_FL_SET(context, CTX_FL_FORCE_MOVE);
   else
       CTX_FL_UNSET(context, CTX_FL_FORCE_MOVE);
+  update_trace_points();
 
   return steps;
 }
@@ -341,6 +464,9 @@ Context_step_over(int argc, VALUE *argv, VALUE self)
     CTX_FL_SET(context, CTX_FL_FORCE_MOVE);
   else
     CTX_FL_UNSET(context, CTX_FL_FORCE_MOVE);
+  /* lines of the current frame are traced only, callees run without hooks */
+  set_step_target(context, frame == Qnil || FIX2INT(frame) == 0 ? frame_iseq(context, 0) : Qnil, 1);
+  update_trace_points();
 
   return Qnil;
 }
@@ -358,6 +484,9 @@ Context_stop_frame(VALUE self, VALUE frame)
      updating stack size.  If that code will be changed this should be changed accordingly.
    */
   debug_context->stop_frame = debug_context->calced_stack_size - FIX2INT(frame) - 1;
+  /* only the return of the finished frame is traced */
+  set_step_target(debug_context, FIX2INT(frame) == 0 ? frame_iseq(debug_context, 0) : Qnil, 0);
+  update_trace_points();
 
   return frame;
 }
@@ -382,6 +511,7 @@ Init_context(VALUE mDebase)
   rb_define_method(cContext, "stack_size", Context_stack_size, 0);
   rb_define_method(cContext, "thread", Context_thread, 0);
   rb_define_method(cContext, "dead?", Context_dead, 0);
+  rb_define_method(cContext, "stopped?", Context_stopped, 0);
   rb_define_method(cContext, "ignored?", Context_ignored, 0);
   rb_define_method(cContext, "thnum", Context_thnum, 0);
   rb_define_method(cContext, "stop_reason", Context_stop_reason, 0);
@@ -389,13 +519,16 @@ Init_context(VALUE mDebase)
   rb_define_method(cContext, "frame_line", Context_frame_line, -1);
   rb_define_method(cContext, "frame_binding", Context_frame_binding, -1);
   rb_define_method(cContext, "frame_self", Context_frame_self, -1);
+  rb_define_method(cContext, "frames", Context_frames, -1);
   rb_define_method(cContext, "stop_next=", Context_stop_next, -1);
   rb_define_method(cContext, "step", Context_stop_next, -1);
   rb_define_method(cContext, "step_over", Context_step_over, -1);
   rb_define_method(cContext, "stop_frame=", Context_stop_frame, 1);
   rb_define_method(cContext, "pause", Context_pause, 0);
 
-  idAlive = rb_intern("alive?");
+  idPath = rb_intern("path");
+  idLineno = rb_intern("lineno");
+  idBaseLabel = rb_intern("base_label");
   context_init_variables();
 
   return cContext;
@@ -1,5 +1,8 @@
 #include <debase_internals.h>
 #include <hacks.h>
+#ifdef HAVE_RB_INTERNAL_THREAD_SPECIFIC_GET
+#include <ruby/thread.h>
+#endif
 
 static VALUE mDebase;                 /* Ruby Debase Module object */
 static VALUE cContext;
@@ -8,23 +11,42 @@ static VALUE cDebugThread;
 static VALUE verbose = Qfalse;
 static VALUE locker = Qnil;
 static VALUE contexts;
+#ifdef HAVE_RB_INTERNAL_THREAD_SPECIFIC_GET
+static rb_internal_thread_specific_key_t context_key;
+/* thread -> cached context, pins both while the raw context is in the thread slot */
+static st_table *cached_contexts = NULL;
+static VALUE cached_contexts_holder = Qnil;
+#else
+static VALUE last_thread = Qnil;
+static VALUE last_context = Qnil;
+#endif
 static VALUE catchpoints;
 static VALUE breakpoints;
-static VALUE file_filter_enabled = Qfalse;
 
 static VALUE tpLine;
 static VALUE tpCall;
 static VALUE tpReturn;
 static VALUE tpRaise;
+static VALUE tpScriptCompiled = Qnil;
+static VALUE tpThreadEnd = Qnil;
 
-static VALUE idAlive;
 static VALUE idAtLine;
 static VALUE idAtBreakpoint;
 static VALUE idAtCatchpoint;
-static VALUE idFileFilter;
-static VALUE idAccept;
+static VALUE idInstructionSequence;
+static VALUE idEvalScript;
+#ifdef DEBASE_TARGETED_TRACEPOINTS
+static ID idTarget;
+#endif
+#ifdef DEBASE_THREAD_TARGETED_TRACEPOINTS
+static ID idEnable;
+static ID idTargetThread;
+#endif
 
 static int started = 0;
+static int lazy_stack_depth = 0;
+/* in non-stop mode a stop halts only the stopped thread */
+static int non_stop = 0;
 
 static void
 print_debug(const char *message, ...)
@@ -42,12 +64,77 @@ check_stop_frame(debug_context_t *context) {
   return context->calced_stack_size == context->stop_frame && context->calced_stack_size >= 0;
 }
 
-static VALUE
-is_path_accepted(VALUE path) {
-  VALUE filter;
-  if (file_filter_enabled == Qfalse) return Qtrue;
-  filter = rb_funcall(mDebase, idFileFilter, 0);
-  return rb_funcall(filter, idAccept, 1, path);
+/* Context objects are cached with their threads, so event handlers do not
+   look them up in the contexts hash. A cached context is always present in
+   the hash, which keeps it alive; it is forgotten when removed from there.
+   The thread slot holds a raw VALUE, so cached contexts are pinned and can't
+   be moved by GC.compact. */
+#ifdef HAVE_RB_INTERNAL_THREAD_SPECIFIC_GET
+static int
+pin_cached_context(st_data_t thread, st_data_t context, st_data_t data)
+{
+  rb_gc_mark((VALUE)thread);
+  rb_gc_mark((VALUE)context);
+  return ST_CONTINUE;
+}
+
+static void
+cached_contexts_mark(void *data)
+{
+  st_foreach(cached_contexts, pin_cached_context, 0);
+}
+
+static inline VALUE
+cached_context(VALUE thread)
+{
+  void *context;
+
+  context = rb_internal_thread_specific_get(thread, context_key);
+  return context == NULL ? Qnil : (VALUE)context;
+}
+
+static inline void
+cache_context(VALUE thread, VALUE context)
+{
+  st_data_t key;
+
+  if (context == Qnil) {
+    key = (st_data_t)thread;
+    st_delete(cached_contexts, &key, NULL);
+  }
+  else {
+    st_insert(cached_contexts, (st_data_t)thread, (st_data_t)context);
+  }
+  rb_internal_thread_specific_set(thread, context_key, context == Qnil ? NULL : (void *)context);
+}
+#else
+static inline VALUE
+cached_context(VALUE thread)
+{
+  return thread == last_thread ? last_context : Qnil;
+}
+
+static inline void
+cache_context(VALUE thread, VALUE context)
+{
+  if (context == Qnil && thread != last_thread) return;
+  last_thread = context == Qnil ? Qnil : thread;
+  last_context = context;
+}
+#endif
+
+static int
+forget_context(VALUE thread, VALUE context, VALUE ignored)
+{
+  cache_context(thread, Qnil);
+  return ST_CONTINUE;
+}
+
+static void
+forget_contexts()
+{
+  if (contexts != Qnil)
+    rb_hash_foreach(contexts, forget_context, 0);
 }
 
 static VALUE
@@ -55,11 +142,15 @@ Debase_thread_context(VALUE self, VALUE thread)
 {
   VALUE context;
 
+  context = cached_context(thread);
+  if (context != Qnil) return context;
+
   context = rb_hash_aref(contexts, thread);
   if (context == Qnil) {
     context = context_create(thread, cDebugThread);
     rb_hash_aset(contexts, thread, context);
   }
+  cache_context(thread, context);
   return context;
 }
 
@@ -69,6 +160,17 @@ Debase_current_context(VALUE self)
   return Debase_thread_context(self, rb_thread_current());
 }
 
+/* returns Qnil for threads ignored by the debugger */
+static inline VALUE
+current_context(debug_context_t **context)
+{
+  VALUE context_object;
+
+  context_object = Debase_thread_context(mDebase, rb_thread_current());
+  Data_Get_Struct(context_object, debug_context_t, *context);
+  return CTX_FL_TEST(*context, CTX_FL_IGNORE) ? Qnil : context_object;
+}
+
 static int
 set_recalc_flag(VALUE thread, VALUE context_object, VALUE ignored)
 {
@@ -80,95 +182,264 @@ set_recalc_flag(VALUE thread, VALUE context_object, VALUE ignored)
   return ST_CONTINUE;
 }
 
+static inline int
+is_stepping(debug_context_t *context)
+{
+  return -1 != context->dest_frame
+      || context->stop_line >= 0
+      || -1 != context->stop_next
+      || context->stop_reason != CTX_STOP_NONE
+      || context->thread_pause != 0;
+}
+
+#define EVENT_LINE   (1<<0)
+#define EVENT_CALL   (1<<1)
+#define EVENT_RETURN (1<<2)
+#define EVENT_RAISE  (1<<3)
+
+typedef struct
+{
+  int events;
+  /* the only stepping thread, Qnil if events are needed in all threads */
+  VALUE thread;
+} event_demand_t;
+
+/* events needed by stepping threads, recomputed when stepping state changes */
+static event_demand_t stepping = {0, Qnil};
+static int stepping_changed = 0;
+/* breakpoints or catchpoints changed since the tracepoints were applied */
+static int trace_points_dirty = 0;
+
+/* the thread line and call/return tracepoints are limited to, Qnil for all threads */
+static VALUE line_thread = Qnil;
+static VALUE call_thread = Qnil;
+static VALUE return_thread = Qnil;
+
 static int
-can_disable_trace_points(VALUE thread, VALUE context_object, VALUE result)
+add_context_events(VALUE thread, VALUE context_object, VALUE result)
 {
+  event_demand_t *demand;
   debug_context_t *context;
+  int events;
 
+  demand = (event_demand_t *)result;
   Data_Get_Struct(context_object, debug_context_t, context);
-
-  if (-1 != context->dest_frame
-      || context->stop_line >= 0
-      || -1 != context->stop_next
-      || context->stop_reason != CTX_STOP_NONE
-      || context->thread_pause != 0)
-  {
-    print_debug("can_disable_tp: %d %d %d %d\n", context->dest_frame, context->stop_line,
-                                                 context->stop_next, context->stop_reason);
-    *((VALUE *) result) = Qfalse;
-    return ST_STOP;
-  }
+  events = 0;
+  /* a step over or a finish confined to an iseq is traced by the context's own tracepoints */
+  if (context->step_iseq != Qnil && context->stop_reason == CTX_STOP_NONE &&
+    context->stop_next == -1 && !context->thread_pause)
+    return ST_CONTINUE;
+  if (is_stepping(context) || context->stop_frame >= 0)
+    events |= EVENT_LINE;
+  /* calced_stack_size is maintained by call/return events, see update_lazy_stack_size */
+  if (context->stop_frame >= 0 || (!lazy_stack_depth && context->dest_frame != -1))
+    events |= EVENT_CALL | EVENT_RETURN;
+  if (events == 0) return ST_CONTINUE;
+
+  /* other threads have to be stopped while the debugger is active */
+  if (demand->thread == Qundef && (context->stop_reason == CTX_STOP_NONE || non_stop))
+    demand->thread = context->thread;
+  else if (demand->thread != context->thread)
+    demand->thread = Qnil;
+  demand->events |= events;
   return ST_CONTINUE;
 }
 
-static void
-try_disable_trace_points()
+#ifdef DEBASE_THREAD_TARGETED_TRACEPOINTS
+static VALUE
+enable_for_thread(VALUE args)
 {
-  VALUE can_disable = Qtrue;
+  VALUE options;
 
-  if (RARRAY_LEN(breakpoints) != 0) return;
-  print_debug("disable_tps: no breakpoints\n");
-  if (!RHASH_EMPTY_P(catchpoints)) return;
-  print_debug("disable_tps: no catchpoints\n");
-  if (rb_tracepoint_enabled_p(tpLine) == Qfalse) return;
-  print_debug("disable_tps: tps are enabled\n");
+  options = rb_hash_new();
+  rb_hash_aset(options, ID2SYM(idTargetThread), RARRAY_AREF(args, 1));
+  return rb_funcallv_kw(RARRAY_AREF(args, 0), idEnable, 1, &options, RB_PASS_KEYWORDS);
+}
+#endif
 
-  rb_hash_foreach(contexts, can_disable_trace_points, (VALUE)&can_disable);
-  if (can_disable == Qfalse) return;
-  print_debug("disable_tps: can disable contexts\n");
+/* Returns 1 if the tracepoint was enabled. When limited to a thread, older
+   rubies trace all threads and the handler rejects the others first thing. */
+static int
+set_trace_point(VALUE trace_point, int enable, VALUE thread, VALUE *current_thread)
+{
+  int enabled;
+#ifdef DEBASE_THREAD_TARGETED_TRACEPOINTS
+  int error;
+#endif
 
-  rb_tracepoint_disable(tpLine);
-  rb_tracepoint_disable(tpCall);
-  rb_tracepoint_disable(tpReturn);
-  rb_tracepoint_disable(tpRaise);
-  rb_hash_foreach(contexts, set_recalc_flag, 0);
+  enabled = rb_tracepoint_enabled_p(trace_point) == Qtrue;
+  if (!enable) {
+    if (enabled) rb_tracepoint_disable(trace_point);
+    if (current_thread != NULL) *current_thread = Qnil;
+    return enabled;
+  }
+  if (enabled && (current_thread == NULL || *current_thread == thread)) return enabled;
+
+  if (enabled) rb_tracepoint_disable(trace_point);
+#ifdef DEBASE_THREAD_TARGETED_TRACEPOINTS
+  if (thread != Qnil) {
+    rb_protect(enable_for_thread, rb_ary_new3(2, trace_point, thread), &error);
+    if (!error) {
+      *current_thread = thread;
+      return enabled;
+    }
+    rb_set_errinfo(Qnil);
+    thread = Qnil;
+  }
+#endif
+  rb_tracepoint_enable(trace_point);
+  if (current_thread != NULL) *current_thread = thread;
+  return enabled;
 }
 
-extern VALUE
-enable_trace_points()
+/* Enables each tracepoint only while something needs its events:
+   line events for untargeted breakpoints and stepping, raise events for
+   catchpoints, call/return events for stepping which depends on stack depth.
+   Events needed only by a stepping thread are traced in that thread. */
+static void
+apply_trace_points()
 {
-  print_debug("enable_tps: \n");
-  if (rb_tracepoint_enabled_p(tpLine) == Qtrue) return Qtrue;
-  print_debug("enable_tps: need to enable\n");
+  VALUE thread;
+  int events;
+  int line_events;
+
+  if (!started) return;
+  trace_points_dirty = 0;
+  events = stepping.events;
+  line_events = breakpoints_need_line_events(breakpoints);
+  if (line_events) events |= EVENT_LINE;
+  if (!RHASH_EMPTY_P(catchpoints)) events |= EVENT_RAISE;
+  print_debug("apply_tps: %d\n", events);
+
+  set_trace_point(tpLine, events & EVENT_LINE, line_events ? Qnil : stepping.thread, &line_thread);
+  set_trace_point(tpRaise, events & EVENT_RAISE, Qnil, NULL);
+  set_trace_point(tpReturn, events & EVENT_RETURN, stepping.thread, &return_thread);
+  /* stack depth has to be taken from the control frames after a gap in call events */
+  thread = call_thread;
+  if (set_trace_point(tpCall, events & EVENT_CALL, stepping.thread, &call_thread) &&
+    (!(events & EVENT_CALL) || thread != call_thread))
+    rb_hash_foreach(contexts, set_recalc_flag, 0);
+}
 
-  rb_tracepoint_enable(tpLine);
-  rb_tracepoint_enable(tpCall);
-  rb_tracepoint_enable(tpReturn);
-  rb_tracepoint_enable(tpRaise);
+/* the events needed by breakpoints or catchpoints may have changed, the
+   tracepoints are applied again when the current event is processed */
+extern void
+invalidate_trace_points()
+{
+  trace_points_dirty = 1;
+}
 
-  return Qfalse;
+extern void
+update_trace_points()
+{
+  if (!started) return;
+  stepping.events = 0;
+  stepping.thread = Qundef;
+  rb_hash_foreach(contexts, add_context_events, (VALUE)&stepping);
+  if (stepping.thread == Qundef) stepping.thread = Qnil;
+  stepping_changed = 0;
+  apply_trace_points();
 }
 
+static inline int
+is_traced_thread(VALUE traced_thread)
+{
+  return traced_thread == Qnil || traced_thread == rb_thread_current();
+}
+
+/* without call/return events stack depth is taken from the control frames */
+static inline void
+update_event_stack_size(debug_context_t *context)
+{
+  if (rb_tracepoint_enabled_p(tpCall) == Qfalse || !is_traced_thread(call_thread))
+    CTX_FL_SET(context, CTX_FL_UPDATE_STACK);
+  update_stack_size(context);
+}
+
+/*
+ *  call-seq:
+ *    Debase.enable_trace_points
+ *
+ *  Enables the tracepoints needed by breakpoints, catchpoints and stepping.
+ */
 static VALUE
 Debase_enable_trace_points(VALUE self)
 {
-  return enable_trace_points();
+  update_trace_points();
+  return Qnil;
+}
+
+/*
+ *  call-seq:
+ *    Debase.active_events -> array
+ *
+ *  Returns the kinds of events currently traced: :line, :call, :return and :raise.
+ */
+static VALUE
+Debase_active_events(VALUE self)
+{
+  VALUE result;
+
+  result = rb_ary_new();
+  if (!started) return result;
+  if (rb_tracepoint_enabled_p(tpLine) == Qtrue) rb_ary_push(result, ID2SYM(rb_intern("line")));
+  if (rb_tracepoint_enabled_p(tpCall) == Qtrue) rb_ary_push(result, ID2SYM(rb_intern("call")));
+  if (rb_tracepoint_enabled_p(tpReturn) == Qtrue) rb_ary_push(result, ID2SYM(rb_intern("return")));
+  if (rb_tracepoint_enabled_p(tpRaise) == Qtrue) rb_ary_push(result, ID2SYM(rb_intern("raise")));
+  return result;
 }
 
 static int
 remove_dead_threads(VALUE thread, VALUE context, VALUE ignored)
 {
-  return (IS_THREAD_ALIVE(thread)) ? ST_CONTINUE : ST_DELETE;
+  if (IS_THREAD_ALIVE(thread)) return ST_CONTINUE;
+  cache_context(thread, Qnil);
+  return ST_DELETE;
 }
 
 static void 
 cleanup(debug_context_t *context)
 {
-  VALUE thread;
+  int stopped;
 
+  stopped = context->stop_reason != CTX_STOP_NONE;
   context->stop_reason = CTX_STOP_NONE;
 
   clear_stack(context);
+  CTX_FL_UNSET(context, CTX_FL_PROCESSING);
 
-  /* release a lock */
-  locker = Qnil;
-  
-  /* let the next thread to run */
-  thread = remove_from_locked();
-  if(thread != Qnil)
-    rb_thread_run(thread);
+  /* release a lock, threads processed in non-stop mode don't hold it */
+  if(locker == context->thread)
+  {
+    locker = Qnil;
+
+    /* let the next waiting thread to run */
+    hand_off_locker();
+  }
+
+  /* stepping commands are issued during a stop */
+  if (stopped || stepping_changed)
+    update_trace_points();
+  else if (trace_points_dirty)
+    apply_trace_points();
+}
+
+/* In lazy mode calced_stack_size is derived from the control frames. C calls
+   are reported before their frame is pushed and C returns after it is popped,
+   everything else is reported from inside the frame. */
+static inline void
+update_lazy_stack_size(debug_context_t *context, rb_trace_point_t *tp)
+{
+  rb_event_flag_t event;
+
+  CTX_FL_SET(context, CTX_FL_UPDATE_STACK);
+  update_stack_size(context);
 
-  try_disable_trace_points();
+  event = rb_tracearg_event_flag(tp);
+  if (event & RUBY_EVENT_C_CALL)
+    ++context->calced_stack_size;
+  else if (event & (RUBY_EVENT_RETURN | RUBY_EVENT_B_RETURN | RUBY_EVENT_END))
+    --context->calced_stack_size;
 }
 
 static int
@@ -184,26 +455,33 @@ check_start_processing(debug_context_t *context, VALUE thread)
     /* halt execution of the current thread if the debugger
        is activated in another
     */
-    while(locker != Qnil && locker != thread)
-    {
-      add_to_locked(thread);
-      rb_thread_stop();
-    }
+    while(!non_stop && ((locker != Qnil && locker != thread) || is_locker_reserved(thread)))
+      wait_for_locker(thread, &context->stopped_ns);
 
     /* stop the current thread if it's marked as suspended */
     if(CTX_FL_TEST(context, CTX_FL_SUSPEND) && locker != thread)
     {
       CTX_FL_SET(context, CTX_FL_WAS_RUNNING);
+      /* don't hold the lock handed to this thread while it is suspended */
+      pass_locker(thread);
       rb_thread_stop();
     }
     else break;
   }
 
-  /* return if the current thread is the locker */
-  if(locker != Qnil) return 0;
+  /* return if the current thread is being processed already */
+  if(CTX_FL_TEST(context, CTX_FL_PROCESSING)) return 0;
 
-  /* only the current thread can proceed */
-  locker = thread;
+  if(!non_stop)
+  {
+    /* return if the current thread is the locker */
+    if(locker != Qnil) return 0;
+
+    /* only the current thread can proceed */
+    locker = thread;
+    locker_taken(thread);
+  }
+  CTX_FL_SET(context, CTX_FL_PROCESSING);
 
   /* ignore a skipped section of code */
   if(CTX_FL_TEST(context, CTX_FL_SKIPPED)) {
@@ -264,15 +542,32 @@ print_event(rb_trace_point_t *tp, debug_context_t *context)
   }
 }
 
+/* what to do once the stack is captured, see stop_in_inspector */
+typedef struct
+{
+  VALUE context_object;
+  debug_context_t *context;
+  debug_file_t *file;
+  int line;
+  VALUE breakpoint;
+  VALUE exception;
+  VALUE exception_name;
+} stop_data_t;
+
+static void stop_at_line(stop_data_t *stop);
+static void stop_at_catchpoint(stop_data_t *stop);
+
 static VALUE
 fill_stack_and_invoke(const rb_debug_inspector_t *inspector, void *data)
 {
-  debug_context_t *context;
-  VALUE context_object;
+  stop_data_t *stop;
 
-  context_object = *(VALUE *)data;
-  Data_Get_Struct(context_object, debug_context_t, context);
-  fill_stack(context, inspector);
+  stop = (stop_data_t *)data;
+  fill_stack(stop->context, inspector);
+  if (stop->exception != Qnil)
+    stop_at_catchpoint(stop);
+  else
+    stop_at_line(stop);
 
   return Qnil;
 }
@@ -280,15 +575,42 @@ fill_stack_and_invoke(const rb_debug_inspector_t *inspector, void *data)
 static VALUE
 start_inspector(VALUE data)
 {
-  return rb_debug_inspector_open(fill_stack_and_invoke, &data);
+  return rb_debug_inspector_open(fill_stack_and_invoke, (void *)data);
 }
 
 static VALUE
 stop_inspector(VALUE data)
 {
+  release_inspector(((stop_data_t *)data)->context);
   return Qnil;
 }
 
+/* The debugger is called while the inspector is still open, the frames
+   are captured from it, see fill_stack. */
+static void
+stop_in_inspector(stop_data_t *stop)
+{
+  stats_timer_t timer;
+
+  /* stepping depths are compared with control frames, see set_step_target */
+  CTX_FL_SET(stop->context, CTX_FL_UPDATE_STACK);
+  update_stack_size(stop->context);
+
+  /* time spent in a stop is not counted to the event handler */
+  stats_start(&timer);
+  rb_ensure(start_inspector, (VALUE)stop, stop_inspector, (VALUE)stop);
+  stats_record_stop(&timer, &stop->context->stopped_ns);
+}
+
+/* In all-stop mode other threads stop at their next line while a thread is
+   stopped, so line events are traced in all threads before handlers run.
+   Stepping tracepoints may be limited to the stepping thread until now. */
+static void
+trace_stop()
+{
+  if (!non_stop) update_trace_points();
+}
+
 static int
 remove_pause_flag(VALUE thread, VALUE context_object, VALUE ignored)
 {
@@ -301,16 +623,20 @@ remove_pause_flag(VALUE thread, VALUE context_object, VALUE ignored)
 }
 
 static void 
-call_at_line(debug_context_t *context, char *file, int line, VALUE context_object)
+call_at_line(debug_context_t *context, debug_file_t *file, int line, VALUE context_object)
 {
   context->hit_user_code = 1;
 
-  rb_hash_foreach(contexts, remove_pause_flag, 0);
+  /* in non-stop mode pauses requested for other threads are still pending */
+  if (non_stop)
+    context->thread_pause = 0;
+  else
+    rb_hash_foreach(contexts, remove_pause_flag, 0);
   CTX_FL_UNSET(context, CTX_FL_STEPPED);
   CTX_FL_UNSET(context, CTX_FL_FORCE_MOVE);
-  context->last_file = file;
+  context->last_file_id = file->id;
   context->last_line = line;
-  rb_funcall(context_object, idAtLine, 2, rb_str_new2(file), INT2FIX(line));
+  rb_funcall(context_object, idAtLine, 2, rb_str_dup(file->path), INT2FIX(line));
 }
 
 int count_stack_size() {
@@ -343,7 +669,7 @@ int count_stack_size() {
 }
 
 static void
-process_line_event(VALUE trace_point, void *data)
+handle_line_event(VALUE trace_point, stats_timer_t *timer)
 {
   VALUE path;
   VALUE lineno;
@@ -351,24 +677,43 @@ process_line_event(VALUE trace_point, void *data)
   VALUE breakpoint;
   debug_context_t *context;
   rb_trace_point_t *tp;
-  char *file;
+  debug_file_t *file;
+  stop_data_t stop;
+  stats_timer_t check_timer;
   int line;
   int moved;
 
-  context_object = Debase_current_context(mDebase);
-  Data_Get_Struct(context_object, debug_context_t, context);
+  context_object = current_context(&context);
+  if (context_object == Qnil) return;
+  stats_exclude_stops(timer, &context->stopped_ns);
+
+  /* logpoints are emitted without taking the locker, the thread goes on
+     unless it is stepping or another breakpoint is set on the line */
+  if (breakpoints_have_logpoints(breakpoints)) {
+    tp = TRACE_POINT;
+    path = rb_tracearg_path(tp);
+    file = NIL_P(path) ? NULL : file_table_intern(path);
+    if (file != NULL && file_filter_accepts(file) &&
+      breakpoints_emit_logpoints(breakpoints, file, FIX2INT(rb_tracearg_lineno(tp)), trace_point) &&
+      !is_stepping(context) && !context->thread_pause)
+      return;
+  }
+
   if (!check_start_processing(context, rb_thread_current())) return;
 
   tp = TRACE_POINT;
   path = rb_tracearg_path(tp);
+  file = NIL_P(path) ? NULL : file_table_intern(path);
 
-  if (is_path_accepted(path)) {
+  if (file != NULL && file_filter_accepts(file)) {
 
     lineno = rb_tracearg_lineno(tp);
-    file = RSTRING_PTR(path);
     line = FIX2INT(lineno);
 
-    update_stack_size(context);
+    if (lazy_stack_depth)
+      update_lazy_stack_size(context, tp);
+    else
+      update_event_stack_size(context);
     print_event(tp, context);
 
     if(context->init_stack_size == -1) {
@@ -382,8 +727,7 @@ process_line_event(VALUE trace_point, void *data)
       moved = 1;
     }
     else {
-      moved = context->last_line != line || context->last_file == NULL ||
-              strcmp(context->last_file, file) != 0;
+      moved = context->last_line != line || context->last_file_id != file->id;
     }
 
     if (context->dest_frame == -1 || context->calced_stack_size == context->dest_frame)
@@ -408,38 +752,235 @@ process_line_event(VALUE trace_point, void *data)
       context->stop_frame = -1;
     }
 
-    breakpoint = breakpoint_find(breakpoints, path, lineno, trace_point);
+    breakpoint = Qnil;
+    if (RARRAY_LEN(breakpoints) > 0) {
+      stats_start(&check_timer);
+      breakpoint = breakpoint_find(breakpoints, file, line, trace_point);
+      stats_record(STAT_BREAKPOINT_CHECK, &check_timer);
+    }
     if (context->stop_next == 0 || context->stop_line == 0 || breakpoint != Qnil) {
-      rb_ensure(start_inspector, context_object, stop_inspector, Qnil);
-      if(context->stack_size <= context->init_stack_size && context->hit_user_code) {
-        context->script_finished = 1;
-      }
-      if(!context->script_finished) {
-        context->stop_reason = CTX_STOP_STEP;
-        if (breakpoint != Qnil) {
-          context->stop_reason = CTX_STOP_BREAKPOINT;
-          rb_funcall(context_object, idAtBreakpoint, 1, breakpoint);
-        }
-        reset_stepping_stop_points(context);
-        call_at_line(context, file, line, context_object);
-      }
+      stop.context_object = context_object;
+      stop.context = context;
+      stop.file = file;
+      stop.line = line;
+      stop.breakpoint = breakpoint;
+      stop.exception = Qnil;
+      stop.exception_name = Qnil;
+      stop_in_inspector(&stop);
     }
   }
   cleanup(context);
 }
 
 static void
-process_return_event(VALUE trace_point, void *data)
+process_line_event(VALUE trace_point, void *data)
+{
+  stats_timer_t timer;
+
+  stats_start(&timer);
+  handle_line_event(trace_point, &timer);
+  stats_record(STAT_LINE_EVENT, &timer);
+}
+
+static void
+stop_at_line(stop_data_t *stop)
+{
+  debug_context_t *context;
+
+  context = stop->context;
+  if(context->stack_size <= context->init_stack_size && context->hit_user_code) {
+    context->script_finished = 1;
+  }
+  if(!context->script_finished) {
+    context->stop_reason = CTX_STOP_STEP;
+    trace_stop();
+    if (stop->breakpoint != Qnil) {
+      context->stop_reason = CTX_STOP_BREAKPOINT;
+      rb_funcall(stop->context_object, idAtBreakpoint, 1, stop->breakpoint);
+    }
+    reset_stepping_stop_points(context);
+    call_at_line(context, stop->file, stop->line, stop->context_object);
+  }
+}
+
+static void
+process_global_line_event(VALUE trace_point, void *data)
+{
+  /* events of a thread being stepped are traced in that thread only */
+  if (!is_traced_thread(line_thread)) return;
+  process_line_event(trace_point, data);
+}
+
+/* line events of iseqs with breakpoints, see breakpoint.c */
+static void
+process_targeted_line_event(VALUE trace_point, void *data)
+{
+  VALUE context_object;
+  debug_context_t *context;
+
+  /* the global line tracepoint handles this event */
+  if (rb_tracepoint_enabled_p(tpLine) == Qtrue && is_traced_thread(line_thread)) return;
+
+  /* calced_stack_size is not maintained without call/return events */
+  context_object = current_context(&context);
+  if (context_object == Qnil) return;
+  CTX_FL_SET(context, CTX_FL_UPDATE_STACK);
+
+  process_line_event(trace_point, data);
+}
+
+/* line events of breakpoint tracepoints, every breakpoint on the line has one */
+static void
+process_breakpoint_line_event(VALUE trace_point, void *data)
+{
+  VALUE path;
+  VALUE tracepoints;
+  rb_trace_point_t *tp;
+
+  tp = TRACE_POINT;
+  path = rb_tracearg_path(tp);
+  if (NIL_P(path)) return;
+  tracepoints = breakpoints_line_tracepoints(breakpoints, file_table_intern(path), FIX2INT(rb_tracearg_lineno(tp)));
+  if (tracepoints == Qnil || !RTEST(rb_ary_includes(tracepoints, trace_point))) return;
+
+  process_targeted_line_event(trace_point, data);
+}
+
+extern VALUE
+targeted_line_tracepoint_new()
+{
+  return rb_tracepoint_new(Qnil, RUBY_EVENT_LINE, process_breakpoint_line_event, NULL);
+}
+
+#ifdef DEBASE_TARGETED_TRACEPOINTS
+/* line events of the iseq a step over is confined to */
+static void
+process_step_line_event(VALUE trace_point, void *data)
+{
+  VALUE context_object;
+  VALUE path;
+  debug_context_t *context;
+  rb_trace_point_t *tp;
+
+  /* every stepping context has its own tracepoint */
+  context_object = current_context(&context);
+  if (context_object == Qnil || context->step_line_tp != trace_point) return;
+
+  /* a breakpoint's tracepoint handles the same event, it must not be processed twice */
+  tp = TRACE_POINT;
+  path = rb_tracearg_path(tp);
+  if (!NIL_P(path) && breakpoints_line_tracepoints(breakpoints, file_table_intern(path), FIX2INT(rb_tracearg_lineno(tp))) != Qnil)
+    return;
+
+  process_targeted_line_event(trace_point, data);
+}
+
+/* return events of the iseq a step over or a finish is confined to */
+static void
+process_step_return_event(VALUE trace_point, void *data)
 {
   VALUE context_object;
   debug_context_t *context;
 
-  context_object = Debase_current_context(mDebase);
+  /* every stepping context has its own tracepoint */
+  context_object = current_context(&context);
+  if (context_object == Qnil || context->step_return_tp != trace_point ||
+      context->step_iseq == Qnil) return;
+
+  /* the returning frame is still on the stack */
+  CTX_FL_SET(context, CTX_FL_UPDATE_STACK);
+  update_stack_size(context);
+
+  if (context->stop_frame >= 0) {
+    /* the finished frame returns, see Context_stop_frame */
+    if (context->calced_stack_size - 1 != context->stop_frame) return;
+    context->stop_next = 1;
+    context->stop_frame = -1;
+  }
+  else {
+    /* the stepped frame returns, stop at the next line of the caller */
+    if (context->calced_stack_size != context->dest_frame) return;
+    context->dest_frame = -1;
+  }
+  set_step_target(context, Qnil, 0);
+  update_trace_points();
+}
+#endif
+
+/* Watches returns of the iseq (and its blocks) and traces its lines when
+   trace_lines is set, so a step over or a finish does not need global
+   tracepoints. Qnil leaves the step to the global tracepoints. */
+extern void
+set_step_target(debug_context_t *context, VALUE iseq, int trace_lines)
+{
+#ifdef DEBASE_TARGETED_TRACEPOINTS
+  VALUE options;
+
+  if (context->step_iseq != Qnil) {
+    if (rb_tracepoint_enabled_p(context->step_line_tp) == Qtrue)
+      rb_tracepoint_disable(context->step_line_tp);
+    rb_tracepoint_disable(context->step_return_tp);
+    context->step_iseq = Qnil;
+  }
+  if (iseq == Qnil) return;
+
+  if (context->step_line_tp == Qnil) {
+    context->step_line_tp = rb_tracepoint_new(Qnil, RUBY_EVENT_LINE, process_step_line_event, NULL);
+    context->step_return_tp = rb_tracepoint_new(Qnil, RUBY_EVENT_RETURN | RUBY_EVENT_B_RETURN,
+                                                process_step_return_event, NULL);
+  }
+  options = rb_hash_new();
+  rb_hash_aset(options, ID2SYM(idTarget), iseq);
+  if (!enable_targeted_tracepoint(context->step_return_tp, options)) return;
+  if (trace_lines && !enable_targeted_tracepoint(context->step_line_tp, options)) {
+    rb_tracepoint_disable(context->step_return_tp);
+    return;
+  }
+  context->step_iseq = iseq;
+#endif
+}
+
+static int
+clear_step_target(VALUE thread, VALUE context_object, VALUE ignored)
+{
+  debug_context_t *context;
+
   Data_Get_Struct(context_object, debug_context_t, context);
+  set_step_target(context, Qnil, 0);
+  return ST_CONTINUE;
+}
+
+#ifdef DEBASE_TARGETED_TRACEPOINTS
+static void
+process_script_compiled_event(VALUE trace_point, void *data)
+{
+  VALUE iseq;
+
+  /* only files are registered, evals do not have breakpoints */
+  if (rb_funcall(trace_point, idEvalScript, 0) != Qnil) return;
+  iseq = rb_funcall(trace_point, idInstructionSequence, 0);
+  if (iseq != Qnil)
+    breakpoints_register_iseq(breakpoints, iseq);
+}
+#endif
+
+static void
+handle_return_event(VALUE trace_point, stats_timer_t *timer)
+{
+  VALUE context_object;
+  debug_context_t *context;
+
+  context_object = current_context(&context);
+  if (context_object == Qnil) return;
+  stats_exclude_stops(timer, &context->stopped_ns);
   if (!check_start_processing(context, rb_thread_current())) return;
 
-  --context->calced_stack_size;
-  update_stack_size(context);
+  if (lazy_stack_depth)
+    update_lazy_stack_size(context, TRACE_POINT);
+  else {
+    --context->calced_stack_size;
+    update_stack_size(context);
+  }
   /* it is important to check stop_frame after stack size updated
      if the order will be changed change Context_stop_frame accordingly.
   */
@@ -447,6 +988,7 @@ process_return_event(VALUE trace_point, void *data)
   {
     context->stop_next = 1;
     context->stop_frame = -1;
+    stepping_changed = 1;
   }
 
   print_event(TRACE_POINT, context);
@@ -454,76 +996,160 @@ process_return_event(VALUE trace_point, void *data)
 }
 
 static void
-process_call_event(VALUE trace_point, void *data)
+process_return_event(VALUE trace_point, void *data)
+{
+  stats_timer_t timer;
+
+  /* events of a thread being stepped are traced in that thread only */
+  if (!is_traced_thread(return_thread)) return;
+
+  stats_start(&timer);
+  handle_return_event(trace_point, &timer);
+  stats_record(STAT_RETURN_EVENT, &timer);
+}
+
+static void
+handle_call_event(VALUE trace_point, stats_timer_t *timer)
 {
   VALUE context_object;
   debug_context_t *context;
 
-  context_object = Debase_current_context(mDebase);
-  Data_Get_Struct(context_object, debug_context_t, context);
+  context_object = current_context(&context);
+  if (context_object == Qnil) return;
+  stats_exclude_stops(timer, &context->stopped_ns);
   if (!check_start_processing(context, rb_thread_current())) return;
 
-  ++context->calced_stack_size;
-  update_stack_size(context);
+  if (lazy_stack_depth)
+    update_lazy_stack_size(context, TRACE_POINT);
+  else {
+    ++context->calced_stack_size;
+    update_stack_size(context);
+  }
   print_event(TRACE_POINT, context);
   cleanup(context);
 }
 
 static void
-process_raise_event(VALUE trace_point, void *data)
+process_call_event(VALUE trace_point, void *data)
+{
+  stats_timer_t timer;
+
+  /* events of a thread being stepped are traced in that thread only */
+  if (!is_traced_thread(call_thread)) return;
+
+  stats_start(&timer);
+  handle_call_event(trace_point, &timer);
+  stats_record(STAT_CALL_EVENT, &timer);
+}
+
+static void
+handle_raise_event(VALUE trace_point, stats_timer_t *timer)
 {
   VALUE path;
   VALUE lineno;
   VALUE context_object;
-  VALUE hit_count;
   VALUE exception_name;
   debug_context_t *context;
   rb_trace_point_t *tp;
-  char *file;
-  int line;
-  int c_hit_count;
+  debug_file_t *file;
+  stop_data_t stop;
 
-  context_object = Debase_current_context(mDebase);
-  Data_Get_Struct(context_object, debug_context_t, context);
+  context_object = current_context(&context);
+  if (context_object == Qnil) return;
+  stats_exclude_stops(timer, &context->stopped_ns);
   if (!check_start_processing(context, rb_thread_current())) return;
 
-  update_stack_size(context);
   tp = TRACE_POINT;
+  if (lazy_stack_depth)
+    update_lazy_stack_size(context, tp);
+  else
+    update_event_stack_size(context);
   if (catchpoint_hit_count(catchpoints, rb_tracearg_raised_exception(tp), &exception_name) != Qnil) {
-    rb_ensure(start_inspector, context_object, stop_inspector, Qnil);
     path = rb_tracearg_path(tp);
+    file = NIL_P(path) ? NULL : file_table_intern(path);
 
-    if (is_path_accepted(path) == Qtrue) {
+    if (file != NULL && file_filter_accepts(file)) {
       lineno = rb_tracearg_lineno(tp);
-      file = RSTRING_PTR(path);
-      line = FIX2INT(lineno);
-      /* On 64-bit systems with gcc and -O2 there seems to be
-         an optimization bug in running INT2FIX(FIX2INT...)..)
-         So we do this in two steps.
-        */
-      c_hit_count = FIX2INT(rb_hash_aref(catchpoints, exception_name)) + 1;
-      hit_count = INT2FIX(c_hit_count);
-      rb_hash_aset(catchpoints, exception_name, hit_count);
-      context->stop_reason = CTX_STOP_CATCHPOINT;
-      rb_funcall(context_object, idAtCatchpoint, 1, rb_tracearg_raised_exception(tp));
-      call_at_line(context, file, line, context_object);
+      stop.context_object = context_object;
+      stop.context = context;
+      stop.file = file;
+      stop.line = FIX2INT(lineno);
+      stop.breakpoint = Qnil;
+      stop.exception = rb_tracearg_raised_exception(tp);
+      stop.exception_name = exception_name;
+      stop_in_inspector(&stop);
     }
   }
 
   cleanup(context);
 }
 
+static void
+process_raise_event(VALUE trace_point, void *data)
+{
+  stats_timer_t timer;
+
+  stats_start(&timer);
+  handle_raise_event(trace_point, &timer);
+  stats_record(STAT_RAISE_EVENT, &timer);
+}
+
+static void
+stop_at_catchpoint(stop_data_t *stop)
+{
+  VALUE hit_count;
+  int c_hit_count;
+
+  /* On 64-bit systems with gcc and -O2 there seems to be
+     an optimization bug in running INT2FIX(FIX2INT...)..)
+     So we do this in two steps.
+    */
+  c_hit_count = FIX2INT(rb_hash_aref(catchpoints, stop->exception_name)) + 1;
+  hit_count = INT2FIX(c_hit_count);
+  rb_hash_aset(catchpoints, stop->exception_name, hit_count);
+  stop->context->stop_reason = CTX_STOP_CATCHPOINT;
+  trace_stop();
+  rb_funcall(stop->context_object, idAtCatchpoint, 1, stop->exception);
+  call_at_line(stop->context, stop->file, stop->line, stop->context_object);
+}
+
+/* contexts are released when their threads end, a stopped context is kept
+   until the debugger resumes it and then dropped by Debase.contexts */
+static void
+process_thread_end_event(VALUE trace_point, void *data)
+{
+  VALUE thread;
+  VALUE context_object;
+  debug_context_t *context;
+
+  thread = rb_thread_current();
+  /* the ending thread can't take a lock queued or reserved for it */
+  locker_remove_thread(thread);
+  context_object = rb_hash_lookup(contexts, thread);
+  if (context_object == Qnil) return;
+  Data_Get_Struct(context_object, debug_context_t, context);
+  if (CTX_FL_TEST(context, CTX_FL_PROCESSING)) return;
+
+  set_step_target(context, Qnil, 0);
+  cache_context(thread, Qnil);
+  rb_hash_delete(contexts, thread);
+  /* the thread could be stepping */
+  if (stepping.events != 0)
+    update_trace_points();
+}
+
 static VALUE
 Debase_setup_tracepoints(VALUE self)
 {
   if (started) return Qnil;
   started = 1;
 
+  forget_contexts();
   contexts = rb_hash_new();
   breakpoints = rb_ary_new();
   catchpoints = rb_hash_new();
 
-  tpLine = rb_tracepoint_new(Qnil, RUBY_EVENT_LINE, process_line_event, NULL);
+  tpLine = rb_tracepoint_new(Qnil, RUBY_EVENT_LINE, process_global_line_event, NULL);
   rb_global_variable(&tpLine);
 
   tpReturn = rb_tracepoint_new(Qnil, RUBY_EVENT_RETURN | RUBY_EVENT_B_RETURN | RUBY_EVENT_C_RETURN | RUBY_EVENT_END,
@@ -537,6 +1163,15 @@ Debase_setup_tracepoints(VALUE self)
   tpRaise = rb_tracepoint_new(Qnil, RUBY_EVENT_RAISE, process_raise_event, NULL);
   rb_global_variable(&tpRaise);
 
+  tpThreadEnd = rb_tracepoint_new(Qnil, RUBY_EVENT_THREAD_END, process_thread_end_event, NULL);
+  rb_global_variable(&tpThreadEnd);
+  rb_tracepoint_enable(tpThreadEnd);
+
+#ifdef DEBASE_TARGETED_TRACEPOINTS
+  tpScriptCompiled = rb_tracepoint_new(Qnil, RUBY_EVENT_SCRIPT_COMPILED, process_script_compiled_event, NULL);
+  rb_tracepoint_enable(tpScriptCompiled);
+#endif
+
   return Qnil;
 }
 
@@ -549,6 +1184,11 @@ Debase_remove_tracepoints(VALUE self)
   if (tpReturn != Qnil) rb_tracepoint_disable(tpReturn);
   if (tpCall != Qnil) rb_tracepoint_disable(tpCall);
   if (tpRaise != Qnil) rb_tracepoint_disable(tpRaise);
+  if (tpScriptCompiled != Qnil) rb_tracepoint_disable(tpScriptCompiled);
+  if (tpThreadEnd != Qnil) rb_tracepoint_disable(tpThreadEnd);
+  if (contexts != Qnil)
+    rb_hash_foreach(contexts, clear_step_target, 0);
+  breakpoints_disable_targets(breakpoints);
 
   return Qnil;
 }
@@ -606,6 +1246,12 @@ values_i(VALUE key, VALUE value, VALUE ary)
     return ST_CONTINUE;
 }
 
+static VALUE
+Debase_contexts_size(VALUE self)
+{
+  return NIL_P(contexts) ? INT2FIX(0) : INT2FIX(RHASH_SIZE(contexts));
+}
+
 static VALUE
 Debase_contexts(VALUE self)
 {
@@ -634,6 +1280,21 @@ Debase_catchpoints(VALUE self)
   return catchpoints; 
 }
 
+/*
+ *  call-seq:
+ *    Debase.register_iseq(iseq)
+ *
+ *  Registers top level iseq of a file loaded without compilation (e.g. by bootsnap),
+ *  so line events can be enabled only for iseqs with breakpoints.
+ */
+static VALUE
+Debase_register_iseq(VALUE self, VALUE iseq)
+{
+  if (started)
+    breakpoints_register_iseq(breakpoints, iseq);
+  return iseq;
+}
+
 static VALUE
 Debase_started(VALUE self)
 {
@@ -667,14 +1328,59 @@ Debase_set_verbose(VALUE self, VALUE value)
 
 /*
  *  call-seq:
- *    Debase.enable_file_filtering(bool)
+ *    Debase.non_stop? -> bool
  *
- *  Enables/disables file filtering.
+ *  Returns +true+ if a stop halts only the stopped thread.
  */
 static VALUE
-Debase_enable_file_filtering(VALUE self, VALUE value)
+Debase_non_stop(VALUE self)
 {
-  file_filter_enabled = RTEST(value) ? Qtrue : Qfalse;
+  return non_stop ? Qtrue : Qfalse;
+}
+
+/*
+ *  call-seq:
+ *    Debase.non_stop = bool
+ *
+ *  In non-stop mode a thread stopped at a breakpoint, catchpoint or step
+ *  doesn't block other threads, they keep running and may stop on their own.
+ *  All-stop mode is the default.
+ */
+static VALUE
+Debase_set_non_stop(VALUE self, VALUE value)
+{
+  non_stop = RTEST(value);
+  update_trace_points();
+  return value;
+}
+
+/*
+ *  call-seq:
+ *    Debase.lazy_stack_depth? -> bool
+ *
+ *  Returns +true+ if stack depth is computed on demand instead of tracing calls and returns.
+ */
+static VALUE
+Debase_lazy_stack_depth(VALUE self)
+{
+  return lazy_stack_depth ? Qtrue : Qfalse;
+}
+
+/*
+ *  call-seq:
+ *    Debase.lazy_stack_depth = bool
+ *
+ *  Computes stack depth from the control frames on demand. Call and return
+ *  events are traced only while "finish" is in progress.
+ */
+static VALUE
+Debase_set_lazy_stack_depth(VALUE self, VALUE value)
+{
+  lazy_stack_depth = RTEST(value);
+  if (started) {
+    rb_hash_foreach(contexts, set_recalc_flag, 0);
+    update_trace_points();
+  }
   return value;
 }
 
@@ -728,13 +1434,15 @@ Debase_init_variables()
   started = 0;
   verbose = Qfalse;
   locker = Qnil;
-  file_filter_enabled = Qfalse;
+  locker_init_variables();
+  forget_contexts();
   contexts = Qnil;
   catchpoints = Qnil;
   breakpoints = Qnil;
 
   context_init_variables();
   breakpoint_init_variables();
+  file_filter_init_variables();
 
   return Qtrue;
 }
@@ -761,24 +1469,44 @@ Init_debase_internals()
   rb_define_module_function(mDebase, "started?", Debase_started, 0);
   rb_define_module_function(mDebase, "verbose?", Debase_verbose, 0);
   rb_define_module_function(mDebase, "verbose=", Debase_set_verbose, 1);
-  rb_define_module_function(mDebase, "enable_file_filtering", Debase_enable_file_filtering, 1);
+  rb_define_module_function(mDebase, "non_stop?", Debase_non_stop, 0);
+  rb_define_module_function(mDebase, "non_stop=", Debase_set_non_stop, 1);
+  rb_define_module_function(mDebase, "lazy_stack_depth?", Debase_lazy_stack_depth, 0);
+  rb_define_module_function(mDebase, "lazy_stack_depth=", Debase_set_lazy_stack_depth, 1);
   rb_define_module_function(mDebase, "enable_trace_points", Debase_enable_trace_points, 0);
+  rb_define_module_function(mDebase, "active_events", Debase_active_events, 0);
   rb_define_module_function(mDebase, "prepare_context", Debase_prepare_context, 0);
   rb_define_module_function(mDebase, "init_variables", Debase_init_variables, 0);
   rb_define_module_function(mDebase, "set_trace_flag_to_iseq", Debase_set_trace_flag_to_iseq, 1);
+  rb_define_module_function(mDebase, "register_iseq", Debase_register_iseq, 1);
 
   //use only for tests
   rb_define_module_function(mDebase, "unset_iseq_flags", Debase_unset_trace_flags, 1);
+  rb_define_module_function(mDebase, "contexts_size", Debase_contexts_size, 0);
 
-  idAlive = rb_intern("alive?");
   idAtLine = rb_intern("at_line");
   idAtBreakpoint = rb_intern("at_breakpoint");
   idAtCatchpoint = rb_intern("at_catchpoint");
-  idFileFilter = rb_intern("file_filter");
-  idAccept = rb_intern("accept?");
+  idInstructionSequence = rb_intern("instruction_sequence");
+  idEvalScript = rb_intern("eval_script");
+#ifdef DEBASE_TARGETED_TRACEPOINTS
+  idTarget = rb_intern("target");
+#endif
+#ifdef DEBASE_THREAD_TARGETED_TRACEPOINTS
+  idEnable = rb_intern("enable");
+  idTargetThread = rb_intern("target_thread");
+#endif
 
   cContext = Init_context(mDebase);
   Init_breakpoint(mDebase);
+  Init_file_table(mDebase);
+  Init_file_filter(mDebase);
+  Init_log_buffer(mDebase);
+  Init_locker(mDebase);
+  Init_sampler(mDebase);
+  Init_signal_start(mDebase);
+  Init_snapshot(mDebase);
+  Init_stats(mDebase);
   cDebugThread  = rb_define_class_under(mDebase, "DebugThread", rb_cThread);
   Debase_init_variables();
 
@@ -786,4 +1514,18 @@ Init_debase_internals()
   rb_global_variable(&breakpoints);
   rb_global_variable(&catchpoints);
   rb_global_variable(&contexts);
+  rb_global_variable(&line_thread);
+  rb_global_variable(&call_thread);
+  rb_global_variable(&return_thread);
+  rb_global_variable(&stepping.thread);
+#ifdef HAVE_RB_INTERNAL_THREAD_SPECIFIC_GET
+  context_key = rb_internal_thread_specific_key_create();
+  cached_contexts = st_init_numtable();
+  cached_contexts_holder = Data_Wrap_Struct(0, cached_contexts_mark, 0, cached_contexts);
+  rb_global_variable(&cached_contexts_holder);
+#else
+  rb_global_variable(&last_thread);
+  rb_global_variable(&last_context);
+#endif
+  rb_global_variable(&tpScriptCompiled);
 }
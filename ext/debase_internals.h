@@ -3,9 +3,40 @@
 
 #include "ruby.h"
 #include "ruby/debug.h"
+#include "ruby/version.h"
+#include <stdint.h>
+#include <time.h>
 
 typedef struct rb_trace_arg_struct rb_trace_point_t;
 
+/* monotonic clock in nanoseconds, used for timing statistics */
+static inline uint64_t
+monotonic_ns()
+{
+#ifdef HAVE_CLOCK_GETTIME
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+  return 0;
+#endif
+}
+
+/* rb_postponed_job_register_one is deprecated since Ruby 3.3 */
+#if defined(HAVE_RB_POSTPONED_JOB_PREREGISTER) || RUBY_API_VERSION_CODE >= 30300
+#define DEBASE_POSTPONED_JOB_PREREGISTER
+#endif
+
+/* TracePoint#enable(target:) comes in Ruby 2.6 together with script_compiled event */
+#ifdef RUBY_EVENT_SCRIPT_COMPILED
+#define DEBASE_TARGETED_TRACEPOINTS
+#endif
+
+/* TracePoint#enable(target_thread:) comes in Ruby 3.2 */
+#if defined(DEBASE_TARGETED_TRACEPOINTS) && RUBY_API_VERSION_CODE >= 30200
+#define DEBASE_THREAD_TARGETED_TRACEPOINTS
+#endif
+
 /* Debase::Context */
 /* flags */
 #define CTX_FL_SUSPEND      (1<<1)
@@ -19,30 +50,37 @@ typedef struct rb_trace_arg_struct rb_trace_point_t;
 #define CTX_FL_FORCE_MOVE   (1<<9)
 #define CTX_FL_CATCHING     (1<<10)
 #define CTX_FL_UPDATE_STACK (1<<11)
+#define CTX_FL_PROCESSING   (1<<12)
 
 /* macro functions */
 #define CTX_FL_TEST(c,f)  ((c)->flags & (f))
 #define CTX_FL_SET(c,f)   do { (c)->flags |= (f); } while (0)
 #define CTX_FL_UNSET(c,f) do { (c)->flags &= ~(f); } while (0)
 
-#define IS_THREAD_ALIVE(t) (rb_funcall((t), idAlive, 0) == Qtrue)
+#define IS_THREAD_ALIVE(t) is_thread_alive(t)
 #define TRACE_POINT (rb_tracearg_from_tracepoint(trace_point))
 
 /* types */
 typedef enum {CTX_STOP_NONE, CTX_STOP_STEP, CTX_STOP_BREAKPOINT, CTX_STOP_CATCHPOINT} ctx_stop_reason;
 
-typedef struct debug_frame_t
+/* path and line are read from the backtrace locations when requested,
+   binding, self and class are captured when the stack is filled */
+typedef struct
 {
-    struct debug_frame_t *prev;
-    const char *file;
+    int index;
     int line;
+    VALUE path;
     VALUE binding;
     VALUE self;
+    VALUE klass;
 } debug_frame_t;
 
 typedef struct debug_context {
-  debug_frame_t *stack;
+  debug_frame_t *frames;
+  int frames_capacity;
   int stack_size;
+  VALUE locations;
+  const rb_debug_inspector_t *inspector;
 
   VALUE thread;
   int thnum;
@@ -53,16 +91,23 @@ typedef struct debug_context {
   int stop_line;
   int stop_frame;
   int thread_pause;
+  /* time the thread spent stopped or waiting for the locker, see stats_record */
+  uint64_t stopped_ns;
 
   /* dest_frame uses calced_stack_size for stepping */
   int dest_frame;
   int calced_stack_size;
 
-  char *last_file;
+  int last_file_id;
   int last_line;
   int init_stack_size;
   int script_finished;
   int hit_user_code;
+
+  /* iseq a step over or a finish is confined to, see set_step_target */
+  VALUE step_iseq;
+  VALUE step_line_tp;
+  VALUE step_return_tp;
 } debug_context_t;
 
 typedef struct
@@ -73,18 +118,56 @@ typedef struct
   VALUE lineno;
 } inspector_data_t;
 
+/* interned files */
+/* types */
+typedef struct
+{
+  int id;
+  VALUE path;
+  char *realpath;
+  int accepted;
+  int filter_generation;
+} debug_file_t;
+
+/* functions */
+extern int file_table_generation;
+extern debug_file_t *file_table_intern(VALUE path);
+extern debug_file_t *file_table_get(int id);
+extern int file_table_size();
+extern void file_table_set_iseq(debug_file_t *file, VALUE iseq);
+extern VALUE file_table_iseq(debug_file_t *file);
+extern void Init_file_table(VALUE mDebase);
+
+/* file filter */
+extern int file_filter_accepts(debug_file_t *file);
+extern void file_filter_init_variables();
+extern void Init_file_filter(VALUE mDebase);
+
 /* functions */
 extern VALUE Init_context(VALUE mDebase);
 extern VALUE context_create(VALUE thread, VALUE cDebugThread);
 extern void reset_stepping_stop_points(debug_context_t *context);
 extern VALUE Context_ignored(VALUE self);
+extern int is_thread_alive(VALUE thread);
 extern void fill_stack(debug_context_t *context, const rb_debug_inspector_t *inspector);
 extern void clear_stack(debug_context_t *context);
+extern void release_inspector(debug_context_t *context);
+extern VALUE frame_iseq(debug_context_t *context, int index);
+extern void set_step_target(debug_context_t *context, VALUE iseq, int trace_lines);
+extern const char *stop_reason_name(debug_context_t *context);
+extern VALUE frame_path(debug_context_t *context, debug_frame_t *frame);
+extern int frame_line(debug_context_t *context, debug_frame_t *frame);
+extern VALUE frame_label(debug_context_t *context, debug_frame_t *frame);
+extern VALUE frame_class(debug_context_t *context, debug_frame_t *frame);
+extern VALUE frame_binding(debug_context_t *context, debug_frame_t *frame);
+extern VALUE frame_self(debug_context_t *context, debug_frame_t *frame);
 
 /* locked threads container */
 /* types */
 typedef struct locked_thread_t {
     VALUE thread;
+    uint64_t since;
+    struct locked_thread_t *prev;
     struct locked_thread_t *next;
 } locked_thread_t;
 
@@ -92,23 +175,125 @@ typedef struct locked_thread_t {
 extern int is_in_locked(VALUE thread_id);
 extern void add_to_locked(VALUE thread);
 extern VALUE remove_from_locked();
-extern VALUE enable_trace_points();
+extern void wait_for_locker(VALUE thread, uint64_t *stopped_ns);
+extern int is_locker_reserved(VALUE thread);
+extern void locker_taken(VALUE thread);
+extern void hand_off_locker();
+extern void pass_locker(VALUE thread);
+extern void locker_remove_thread(VALUE thread);
+extern void locker_init_variables();
+extern void Init_locker(VALUE mDebase);
+extern void update_trace_points();
+extern void invalidate_trace_points();
+extern VALUE targeted_line_tracepoint_new();
+extern int enable_targeted_tracepoint(VALUE tracepoint, VALUE options);
+extern VALUE breakpoints_line_tracepoints(VALUE breakpoints, debug_file_t *file, int line);
 
 /* breakpoints and catchpoints */
 /* types */
+
+/* Ruby expression compiled once into a lambda evaluated against a frame binding */
+typedef struct
+{
+  VALUE proc;
+  VALUE error;
+  /* class the proc resolves constants in */
+  VALUE klass;
+  int use_eval;
+} compiled_expr_t;
+
+typedef enum {HIT_COND_NONE, HIT_COND_GE, HIT_COND_EQ, HIT_COND_MOD} hit_condition_t;
+
 typedef struct
 {
   VALUE enabled;
   VALUE source;
   VALUE expr;
+  compiled_expr_t compiled_expr;
   int line;
   int id;
+
+  int hit_count;
+  int hit_value;
+  hit_condition_t hit_condition;
+  /* the breakpoint stops only this thread if set */
+  VALUE thread;
+
+  /* logpoints render the message instead of stopping */
+  VALUE log_message;
+  VALUE log_expr;
+  compiled_expr_t compiled_log;
+
+  /* result of the last file name comparison, see file_table_generation */
+  int match_file_id;
+  int match_generation;
+  int match_result;
+
+  /* line tracepoints enabled only for iseqs of the matching files */
+  VALUE tracepoints;
 } breakpoint_t;
 
 extern VALUE catchpoint_hit_count(VALUE catchpoints, VALUE exception, VALUE *exception_name);
-extern VALUE breakpoint_find(VALUE breakpoints, VALUE source, VALUE pos, VALUE trace_point);
+extern VALUE breakpoint_find(VALUE breakpoints, debug_file_t *file, int line, VALUE trace_point);
+extern int breakpoints_need_line_events(VALUE breakpoints);
+extern void breakpoints_register_iseq(VALUE breakpoints, VALUE iseq);
+extern void breakpoints_disable_targets(VALUE breakpoints);
+extern int breakpoints_have_logpoints(VALUE breakpoints);
+extern int breakpoints_emit_logpoints(VALUE breakpoints, debug_file_t *file, int line, VALUE trace_point);
 extern void Init_breakpoint(VALUE mDebase);
 
 extern void breakpoint_init_variables();
+
+/* logpoint messages */
+extern void log_buffer_push(VALUE message);
+extern void Init_log_buffer(VALUE mDebase);
+extern void Init_sampler(VALUE mDebase);
+extern void Init_signal_start(VALUE mDebase);
+extern void Init_snapshot(VALUE mDebase);
+
+/* statistics */
+typedef enum {
+  STAT_LINE_EVENT,
+  STAT_CALL_EVENT,
+  STAT_RETURN_EVENT,
+  STAT_RAISE_EVENT,
+  STAT_BREAKPOINT_CHECK,
+  STAT_CONDITION_EVAL,
+  STAT_LOCKER_WAIT,
+  STAT_KINDS
+} stat_kind_t;
+
+#define STAT_HISTOGRAM_SIZE 32
+
+typedef struct {
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t histogram[STAT_HISTOGRAM_SIZE];
+} debug_stat_t;
+
+typedef struct {
+  uint64_t start;
+  uint64_t stopped;
+  uint64_t *stopped_ns;
+} stats_timer_t;
+
+static inline void
+stats_start(stats_timer_t *timer)
+{
+  timer->stopped_ns = NULL;
+  timer->start = monotonic_ns();
+}
+
+/* time added to stopped_ns until the timer is recorded is not counted */
+static inline void
+stats_exclude_stops(stats_timer_t *timer, uint64_t *stopped_ns)
+{
+  timer->stopped_ns = stopped_ns;
+  timer->stopped = *stopped_ns;
+}
+
+extern void stats_record(stat_kind_t kind, stats_timer_t *timer);
+extern void stats_record_stop(stats_timer_t *timer, uint64_t *stopped_ns);
+extern void Init_stats(VALUE mDebase);
 extern void context_init_variables();
 #endif
@@ -50,6 +50,8 @@ if ENV['debase_debug']
 end
 
 dir_config("ruby")
+have_func("rb_internal_thread_specific_get", "ruby/thread.h")
+have_func("rb_postponed_job_preregister", "ruby/debug.h")
 if !Debase::RubyCoreSource.create_makefile_with_core(hdrs, "debase_internals")
   STDERR.print("Makefile creation failed\n")
   STDERR.print("*************************************************************\n\n")
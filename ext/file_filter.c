@@ -0,0 +1,266 @@
+#include <debase_internals.h>
+
+/* File filter. Included and excluded path prefixes are kept in a byte trie,
+   so a path is checked in a single pass over its characters. Verdicts are
+   cached per interned file and dropped when the filter is changed. */
+
+#define PREFIX_NONE     0
+#define PREFIX_INCLUDED 1
+#define PREFIX_EXCLUDED 2
+
+typedef struct prefix_node_t prefix_node_t;
+struct prefix_node_t {
+  unsigned char byte;
+  int kind;
+  prefix_node_t *child;
+  prefix_node_t *sibling;
+};
+
+typedef struct {
+  int enabled;
+  prefix_node_t root;
+} file_filter_t;
+
+static VALUE cFileFilter;
+static VALUE active_filter = Qnil;
+static int filter_generation = 0;
+
+static void
+free_nodes(prefix_node_t *node)
+{
+  prefix_node_t *next;
+
+  while (node != NULL) {
+    next = node->sibling;
+    free_nodes(node->child);
+    xfree(node);
+    node = next;
+  }
+}
+
+static void
+FileFilter_free(file_filter_t *filter)
+{
+  free_nodes(filter->root.child);
+  xfree(filter);
+}
+
+static VALUE
+FileFilter_alloc(VALUE klass)
+{
+  file_filter_t *filter;
+
+  filter = ALLOC(file_filter_t);
+  filter->enabled = 0;
+  filter->root.byte = 0;
+  filter->root.kind = PREFIX_NONE;
+  filter->root.child = NULL;
+  filter->root.sibling = NULL;
+  return Data_Wrap_Struct(klass, 0, FileFilter_free, filter);
+}
+
+static prefix_node_t *
+find_or_add_node(prefix_node_t *root, VALUE prefix)
+{
+  prefix_node_t *node, *child;
+  const unsigned char *ptr, *end;
+
+  node = root;
+  ptr = (const unsigned char *)RSTRING_PTR(prefix);
+  end = ptr + RSTRING_LEN(prefix);
+  for (; ptr < end; ptr++) {
+    for (child = node->child; child != NULL && child->byte != *ptr; child = child->sibling);
+    if (child == NULL) {
+      child = ALLOC(prefix_node_t);
+      child->byte = *ptr;
+      child->kind = PREFIX_NONE;
+      child->child = NULL;
+      child->sibling = node->child;
+      node->child = child;
+    }
+    node = child;
+  }
+  return node;
+}
+
+static int
+filter_accepts(file_filter_t *filter, VALUE path)
+{
+  prefix_node_t *node;
+  const unsigned char *ptr, *end;
+  int included;
+
+  node = &filter->root;
+  included = 0;
+  ptr = (const unsigned char *)RSTRING_PTR(path);
+  end = ptr + RSTRING_LEN(path);
+  for (;;) {
+    if (node->kind == PREFIX_EXCLUDED) return 0;
+    if (node->kind == PREFIX_INCLUDED) included = 1;
+    if (ptr == end) break;
+    for (node = node->child; node != NULL && node->byte != *ptr; node = node->sibling);
+    if (node == NULL) break;
+    ptr++;
+  }
+  return included;
+}
+
+extern int
+file_filter_accepts(debug_file_t *file)
+{
+  file_filter_t *filter;
+
+  if (active_filter == Qnil) return 1;
+  if (file->filter_generation != filter_generation) {
+    Data_Get_Struct(active_filter, file_filter_t, filter);
+    file->accepted = filter_accepts(filter, file->path);
+    file->filter_generation = filter_generation;
+  }
+  return file->accepted;
+}
+
+static void
+update_prefix(VALUE self, VALUE file_path, int kind)
+{
+  file_filter_t *filter;
+  prefix_node_t *node;
+
+  Data_Get_Struct(self, file_filter_t, filter);
+  node = find_or_add_node(&filter->root, StringValue(file_path));
+  /* adding a prefix of the other kind cancels it */
+  node->kind = node->kind == PREFIX_NONE || node->kind == kind ? kind : PREFIX_NONE;
+  filter_generation++;
+}
+
+/*
+ *  call-seq:
+ *    file_filter.include(file_path)
+ *
+ *  Accepts files which paths start with file_path.
+ */
+static VALUE
+FileFilter_include(VALUE self, VALUE file_path)
+{
+  update_prefix(self, file_path, PREFIX_INCLUDED);
+  return self;
+}
+
+/*
+ *  call-seq:
+ *    file_filter.exclude(file_path)
+ *
+ *  Rejects files which paths start with file_path.
+ */
+static VALUE
+FileFilter_exclude(VALUE self, VALUE file_path)
+{
+  update_prefix(self, file_path, PREFIX_EXCLUDED);
+  return self;
+}
+
+static void
+set_enabled(VALUE self, int enabled)
+{
+  file_filter_t *filter;
+
+  Data_Get_Struct(self, file_filter_t, filter);
+  filter->enabled = enabled;
+  if (enabled)
+    active_filter = self;
+  else if (active_filter == self)
+    active_filter = Qnil;
+  filter_generation++;
+}
+
+/*
+ *  call-seq:
+ *    file_filter.enable
+ *
+ *  Starts filtering line events with this filter.
+ */
+static VALUE
+FileFilter_enable(VALUE self)
+{
+  set_enabled(self, 1);
+  return Qtrue;
+}
+
+/*
+ *  call-seq:
+ *    file_filter.disable
+ *
+ *  Stops filtering line events.
+ */
+static VALUE
+FileFilter_disable(VALUE self)
+{
+  set_enabled(self, 0);
+  return Qfalse;
+}
+
+/*
+ *  call-seq:
+ *    file_filter.accept?(file_path) -> bool
+ *
+ *  Returns true if the file passes the filter.
+ */
+static VALUE
+FileFilter_accept(VALUE self, VALUE file_path)
+{
+  file_filter_t *filter;
+
+  Data_Get_Struct(self, file_filter_t, filter);
+  if (!filter->enabled) return Qtrue;
+  if (NIL_P(file_path)) return Qfalse;
+  return filter_accepts(filter, StringValue(file_path)) ? Qtrue : Qfalse;
+}
+
+/*
+ *  call-seq:
+ *    Debase.enable_file_filtering(bool)
+ *
+ *  Enables/disables file filtering.
+ */
+static VALUE
+Debase_enable_file_filtering(VALUE self, VALUE value)
+{
+  set_enabled(rb_funcall(self, rb_intern("file_filter"), 0), RTEST(value));
+  return value;
+}
+
+/*
+ *  call-seq:
+ *    Debase.invalidate_file_filter
+ *
+ *  Drops cached file filter verdicts.
+ */
+static VALUE
+Debase_invalidate_file_filter(VALUE self)
+{
+  filter_generation++;
+  return Qnil;
+}
+
+extern void
+file_filter_init_variables()
+{
+  active_filter = Qnil;
+  filter_generation++;
+}
+
+extern void
+Init_file_filter(VALUE mDebase)
+{
+  cFileFilter = rb_define_class_under(mDebase, "FileFilter", rb_cObject);
+  rb_define_alloc_func(cFileFilter, FileFilter_alloc);
+  rb_define_method(cFileFilter, "include", FileFilter_include, 1);
+  rb_define_method(cFileFilter, "exclude", FileFilter_exclude, 1);
+  rb_define_method(cFileFilter, "enable", FileFilter_enable, 0);
+  rb_define_method(cFileFilter, "disable", FileFilter_disable, 0);
+  rb_define_method(cFileFilter, "accept?", FileFilter_accept, 1);
+
+  rb_define_module_function(mDebase, "enable_file_filtering", Debase_enable_file_filtering, 1);
+  rb_define_module_function(mDebase, "invalidate_file_filter", Debase_invalidate_file_filter, 0);
+
+  rb_global_variable(&active_filter);
+}
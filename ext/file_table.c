@@ -0,0 +1,183 @@
+#include <debase_internals.h>
+#include <ruby/util.h>
+
+/* Interned files table. Every path reported by the TracePoint API gets
+   a small integer id and its real path is resolved only once, so the
+   line event handler can compare files by id. */
+
+static debug_file_t **files = NULL;
+static int files_count = 0;
+static int files_capacity = 0;
+
+/* frozen path object -> file id, its keys are pinned by file_table_mark.
+   Cleared when full, evals create a new path object for every call. */
+#define FILE_OBJECTS_CACHE_SIZE 1024
+static st_table *file_by_object = NULL;
+/* path string -> file id */
+static VALUE file_ids = Qnil;
+/* marks the objects referenced from the table */
+static VALUE file_table_holder = Qnil;
+/* file id -> top level iseq the file was compiled to */
+static VALUE file_iseqs = Qnil;
+
+int file_table_generation = 0;
+
+static char *
+resolve_realpath(const char *file)
+{
+#ifdef _WIN32
+  return ruby_strdup(file);
+#else
+#ifdef PATH_MAX
+  char path[PATH_MAX + 1];
+  path[PATH_MAX] = 0;
+  return ruby_strdup(realpath(file, path) != NULL ? path : file);
+#else
+  char *path;
+  char *result;
+  path = realpath(file, NULL);
+  result = ruby_strdup(path == NULL ? file : path);
+  free(path);
+  return result;
+#endif
+#endif
+}
+
+static debug_file_t *
+add_file(VALUE path)
+{
+  debug_file_t *file;
+
+  if (files_count == files_capacity) {
+    files_capacity = files_capacity == 0 ? 64 : files_capacity * 2;
+    REALLOC_N(files, debug_file_t *, files_capacity);
+  }
+
+  path = rb_str_new_frozen(path);
+  file = ALLOC(debug_file_t);
+  file->id = files_count;
+  file->path = path;
+  file->realpath = resolve_realpath(RSTRING_PTR(path));
+  file->accepted = 1;
+  file->filter_generation = -1;
+
+  files[files_count++] = file;
+  rb_hash_aset(file_ids, path, INT2FIX(file->id));
+  return file;
+}
+
+extern debug_file_t *
+file_table_intern(VALUE path)
+{
+  st_data_t id;
+  VALUE id_value;
+  debug_file_t *file;
+
+  /* iseq paths are frozen, so the same object is seen for every line of a file */
+  if (OBJ_FROZEN(path) && st_lookup(file_by_object, (st_data_t)path, &id))
+    return files[id];
+
+  id_value = rb_hash_lookup(file_ids, path);
+  file = id_value == Qnil ? add_file(path) : files[FIX2INT(id_value)];
+
+  if (OBJ_FROZEN(path)) {
+    if (file_by_object->num_entries >= FILE_OBJECTS_CACHE_SIZE)
+      st_clear(file_by_object);
+    st_insert(file_by_object, (st_data_t)path, (st_data_t)file->id);
+  }
+  return file;
+}
+
+extern debug_file_t *
+file_table_get(int id)
+{
+  if (id < 0 || id >= files_count) return NULL;
+  return files[id];
+}
+
+extern int
+file_table_size()
+{
+  return files_count;
+}
+
+/* only the last compiled iseq is kept, reloaded files replace the old one */
+extern void
+file_table_set_iseq(debug_file_t *file, VALUE iseq)
+{
+  rb_ary_store(file_iseqs, file->id, iseq);
+}
+
+extern VALUE
+file_table_iseq(debug_file_t *file)
+{
+  return rb_ary_entry(file_iseqs, file->id);
+}
+
+static void
+invalidate_file(debug_file_t *file)
+{
+  xfree(file->realpath);
+  file->realpath = resolve_realpath(RSTRING_PTR(file->path));
+  file->filter_generation = -1;
+}
+
+/*
+ *  call-seq:
+ *    Debase.invalidate_file(path = nil)
+ *
+ *  Resolves real path of the given file (or of all known files) again.
+ *  Should be called when files are reloaded or symlinks are changed.
+ */
+static VALUE
+Debase_invalidate_file(int argc, VALUE *argv, VALUE self)
+{
+  VALUE path;
+  VALUE id_value;
+  int i;
+
+  rb_scan_args(argc, argv, "01", &path);
+  if (NIL_P(path)) {
+    for (i = 0; i < files_count; i++)
+      invalidate_file(files[i]);
+  }
+  else {
+    id_value = rb_hash_lookup(file_ids, StringValue(path));
+    if (id_value == Qnil) return Qfalse;
+    invalidate_file(files[FIX2INT(id_value)]);
+  }
+  file_table_generation++;
+  return Qtrue;
+}
+
+static int
+mark_file_object(st_data_t key, st_data_t value, st_data_t data)
+{
+  rb_gc_mark((VALUE)key);
+  return ST_CONTINUE;
+}
+
+/* rb_gc_mark pins the objects, so the addresses used as keys stay valid during compaction */
+static void
+file_table_mark(void *data)
+{
+  int i;
+
+  for (i = 0; i < files_count; i++)
+    rb_gc_mark(files[i]->path);
+  st_foreach(file_by_object, mark_file_object, 0);
+}
+
+extern void
+Init_file_table(VALUE mDebase)
+{
+  file_by_object = st_init_numtable();
+  file_ids = rb_hash_new();
+  file_iseqs = rb_ary_new();
+  file_table_holder = Data_Wrap_Struct(0, file_table_mark, 0, &files);
+  rb_global_variable(&file_ids);
+  rb_global_variable(&file_iseqs);
+  rb_global_variable(&file_table_holder);
+
+  rb_define_module_function(mDebase, "invalidate_file", Debase_invalidate_file, -1);
+}
@@ -29,3 +29,14 @@ update_stack_size(debug_context_t *context)
     CTX_FL_UNSET(context, CTX_FL_UPDATE_STACK);
   }
 }
+
+/* same as Thread#alive? without a method call, a thread is dead once its
+   block returned even though its status is set to killed only later */
+extern int
+is_thread_alive(VALUE thread)
+{
+  rb_thread_t *th;
+
+  th = (rb_thread_t *)RTYPEDDATA_DATA(thread);
+  return th->status != THREAD_KILLED && th->value == Qundef;
+}
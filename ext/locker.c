@@ -1,19 +1,26 @@
 #include <debase_internals.h>
+
+/* Threads waiting for the debugger lock, in arrival order. The lock is
+   handed to the first waiter when released, so threads which were not
+   waiting can't take it first and no waiter is woken in vain. */
 static locked_thread_t *locked_head = NULL;
 static locked_thread_t *locked_tail = NULL;
+/* thread -> its node in the queue, the threads are pinned by locked_mark */
+static st_table *locked_nodes = NULL;
+static VALUE locked_holder = Qnil;
+/* the waiter the lock was handed to, other threads wait until it takes the lock */
+static VALUE next_locker = Qnil;
+
+static long locked_count = 0;
+static long max_locked_count = 0;
+static long waits_count = 0;
+static long handoffs_count = 0;
+static uint64_t wait_time_ns = 0;
 
 extern int
 is_in_locked(VALUE thread)
 {
-  locked_thread_t *node;
-
-  if(!locked_head) return 0;
-
-  for(node = locked_head; node != locked_tail; node = node->next)
-  {
-    if(node->thread == thread) return 1;
-  }
-  return 0;
+  return locked_nodes != NULL && st_lookup(locked_nodes, (st_data_t)thread, NULL);
 }
 
 extern void
@@ -25,28 +32,200 @@ add_to_locked(VALUE thread)
 
   node = ALLOC(locked_thread_t);
   node->thread = thread;
+  node->since = monotonic_ns();
   node->next = NULL;
+  node->prev = locked_tail;
   if(locked_tail)
     locked_tail->next = node;
   locked_tail = node;
   if(!locked_head)
     locked_head = node;
+  st_insert(locked_nodes, (st_data_t)thread, (st_data_t)node);
+
+  waits_count++;
+  if(++locked_count > max_locked_count)
+    max_locked_count = locked_count;
+}
+
+static void
+unlink_locked(locked_thread_t *node)
+{
+  st_data_t thread;
+
+  if(node->prev) node->prev->next = node->next; else locked_head = node->next;
+  if(node->next) node->next->prev = node->prev; else locked_tail = node->prev;
+  thread = (st_data_t)node->thread;
+  st_delete(locked_nodes, &thread, NULL);
+  wait_time_ns += monotonic_ns() - node->since;
+  locked_count--;
+  xfree(node);
 }
 
 extern VALUE
 remove_from_locked()
 {
   VALUE thread;
-  locked_thread_t *node;
 
   if(locked_head == NULL)
     return Qnil;
 
-  node = locked_head;
-  locked_head = locked_head->next;
-  if(locked_tail == node)
-    locked_tail = NULL;
-  thread = node->thread;
-  xfree(node);
+  thread = locked_head->thread;
+  unlink_locked(locked_head);
   return thread;
 }
+
+typedef struct {
+  VALUE thread;
+  int woken;
+} locker_wait_t;
+
+static VALUE
+stop_waiting_thread(VALUE data)
+{
+  locker_wait_t *wait = (locker_wait_t *)data;
+
+  add_to_locked(wait->thread);
+  rb_thread_stop();
+  wait->woken = 1;
+  return Qnil;
+}
+
+/* removes the thread from the queue and passes on a lock reserved for it */
+extern void
+locker_remove_thread(VALUE thread)
+{
+  st_data_t node;
+
+  if(locked_nodes != NULL && st_lookup(locked_nodes, (st_data_t)thread, &node))
+    unlink_locked((locked_thread_t *)node);
+  pass_locker(thread);
+}
+
+/* a thread leaving the wait by Thread#raise or Thread#kill must not stay
+   queued or keep the lock reserved, other threads would wait for it forever */
+static VALUE
+leave_locker_wait(VALUE data)
+{
+  locker_wait_t *wait = (locker_wait_t *)data;
+
+  if(!wait->woken)
+    locker_remove_thread(wait->thread);
+  return Qnil;
+}
+
+/* the current thread waits until the lock is released or handed to it,
+   the wait is added to stopped_ns of the thread */
+extern void
+wait_for_locker(VALUE thread, uint64_t *stopped_ns)
+{
+  stats_timer_t timer;
+  locker_wait_t wait;
+
+  wait.thread = thread;
+  wait.woken = 0;
+  stats_start(&timer);
+  rb_ensure(stop_waiting_thread, (VALUE)&wait, leave_locker_wait, (VALUE)&wait);
+  stats_record(STAT_LOCKER_WAIT, &timer);
+  stats_record_stop(&timer, stopped_ns);
+}
+
+/* returns 1 if the lock was handed to another thread which did not take it yet */
+extern int
+is_locker_reserved(VALUE thread)
+{
+  if(next_locker == Qnil || next_locker == thread) return 0;
+  if(IS_THREAD_ALIVE(next_locker)) return 1;
+  next_locker = Qnil;
+  return 0;
+}
+
+extern void
+locker_taken(VALUE thread)
+{
+  st_data_t node;
+
+  if(next_locker == thread)
+    next_locker = Qnil;
+  /* the thread could be woken up by someone else while waiting */
+  if(locked_nodes != NULL && st_lookup(locked_nodes, (st_data_t)thread, &node))
+    unlink_locked((locked_thread_t *)node);
+}
+
+/* wakes up the first alive waiter and reserves the released lock for it */
+extern void
+hand_off_locker()
+{
+  VALUE thread;
+
+  while((thread = remove_from_locked()) != Qnil)
+  {
+    if(!IS_THREAD_ALIVE(thread)) continue;
+    next_locker = thread;
+    handoffs_count++;
+    rb_thread_run(thread);
+    return;
+  }
+}
+
+/* hands the lock reserved for the thread to the next waiter */
+extern void
+pass_locker(VALUE thread)
+{
+  if(next_locker != thread) return;
+  next_locker = Qnil;
+  hand_off_locker();
+}
+
+/*
+ *  call-seq:
+ *    Debase.locker_stats -> hash
+ *
+ *  Returns debugger lock contention counters: number of waits, total wait
+ *  time in seconds, number of hand-offs, current and maximum queue length.
+ */
+static VALUE
+Debase_locker_stats(VALUE self)
+{
+  VALUE result;
+
+  result = rb_hash_new();
+  rb_hash_aset(result, ID2SYM(rb_intern("waits")), LONG2NUM(waits_count));
+  rb_hash_aset(result, ID2SYM(rb_intern("wait_time")), DBL2NUM(wait_time_ns / 1e9));
+  rb_hash_aset(result, ID2SYM(rb_intern("handoffs")), LONG2NUM(handoffs_count));
+  rb_hash_aset(result, ID2SYM(rb_intern("queue_length")), LONG2NUM(locked_count));
+  rb_hash_aset(result, ID2SYM(rb_intern("max_queue_length")), LONG2NUM(max_locked_count));
+  return result;
+}
+
+extern void
+locker_init_variables()
+{
+  while(remove_from_locked() != Qnil);
+  next_locker = Qnil;
+  max_locked_count = 0;
+  waits_count = 0;
+  handoffs_count = 0;
+  wait_time_ns = 0;
+}
+
+/* rb_gc_mark pins the threads, so their addresses used as keys stay valid,
+   a queued thread is not freed even if its context was released */
+static void
+locked_mark(void *data)
+{
+  locked_thread_t *node;
+
+  for(node = locked_head; node != NULL; node = node->next)
+    rb_gc_mark(node->thread);
+}
+
+extern void
+Init_locker(VALUE mDebase)
+{
+  locked_nodes = st_init_numtable();
+  locked_holder = Data_Wrap_Struct(0, locked_mark, 0, &locked_head);
+  rb_global_variable(&next_locker);
+  rb_global_variable(&locked_holder);
+
+  rb_define_module_function(mDebase, "locker_stats", Debase_locker_stats, 0);
+}
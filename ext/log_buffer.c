@@ -0,0 +1,105 @@
+#include <debase_internals.h>
+
+/* Ring buffer of logpoint messages. Messages are appended by the line event
+   handler and taken by Debase.flush_logpoints, normally called from a debugger
+   thread. When the buffer is full the oldest message is dropped. */
+
+#define DEFAULT_CAPACITY 1024
+
+static VALUE messages = Qnil;
+static long capacity = DEFAULT_CAPACITY;
+static long head = 0;
+static long count = 0;
+static long dropped = 0;
+
+extern void
+log_buffer_push(VALUE message)
+{
+  if (count == capacity) {
+    head = (head + 1) % capacity;
+    count--;
+    dropped++;
+  }
+  rb_ary_store(messages, (head + count) % capacity, message);
+  count++;
+}
+
+/*
+ *  call-seq:
+ *    Debase.flush_logpoints -> array
+ *
+ *  Returns buffered logpoint messages, oldest first, and empties the buffer.
+ */
+static VALUE
+Debase_flush_logpoints(VALUE self)
+{
+  VALUE result;
+  long i;
+
+  result = rb_ary_new2(count);
+  for (i = 0; i < count; i++) {
+    rb_ary_push(result, rb_ary_entry(messages, (head + i) % capacity));
+    rb_ary_store(messages, (head + i) % capacity, Qnil);
+  }
+  head = 0;
+  count = 0;
+  return result;
+}
+
+/*
+ *  call-seq:
+ *    Debase.logpoints_dropped -> int
+ *
+ *  Returns the number of messages dropped because the buffer was full.
+ */
+static VALUE
+Debase_logpoints_dropped(VALUE self)
+{
+  return LONG2NUM(dropped);
+}
+
+/*
+ *  call-seq:
+ *    Debase.logpoint_buffer_size -> int
+ *
+ *  Returns the maximum number of buffered logpoint messages.
+ */
+static VALUE
+Debase_logpoint_buffer_size(VALUE self)
+{
+  return LONG2NUM(capacity);
+}
+
+/*
+ *  call-seq:
+ *    Debase.logpoint_buffer_size = int
+ *
+ *  Sets the maximum number of buffered logpoint messages, pending messages are dropped.
+ */
+static VALUE
+Debase_set_logpoint_buffer_size(VALUE self, VALUE size)
+{
+  long new_capacity;
+
+  new_capacity = NUM2LONG(size);
+  if (new_capacity <= 0)
+    rb_raise(rb_eArgError, "buffer size must be positive");
+  dropped += count;
+  capacity = new_capacity;
+  messages = rb_ary_new2(capacity);
+  head = 0;
+  count = 0;
+  return size;
+}
+
+extern void
+Init_log_buffer(VALUE mDebase)
+{
+  messages = rb_ary_new2(capacity);
+  rb_global_variable(&messages);
+
+  rb_define_module_function(mDebase, "flush_logpoints", Debase_flush_logpoints, 0);
+  rb_define_module_function(mDebase, "logpoints_dropped", Debase_logpoints_dropped, 0);
+  rb_define_module_function(mDebase, "logpoint_buffer_size", Debase_logpoint_buffer_size, 0);
+  rb_define_module_function(mDebase, "logpoint_buffer_size=", Debase_set_logpoint_buffer_size, 1);
+}
@@ -0,0 +1,277 @@
+#include <debase_internals.h>
+#include <signal.h>
+#ifndef _WIN32
+#include <sys/time.h>
+#endif
+
+/* Sampling profiler. A profiling timer signal schedules a postponed job,
+   which records the stack of the running thread with rb_profile_frames
+   into preallocated buffers. No TracePoints are used, so the program runs
+   at full speed between samples. */
+
+#if defined(SIGPROF) && !defined(_WIN32)
+#define DEBASE_SAMPLER
+#endif
+
+#define MAX_SAMPLE_DEPTH 256
+
+typedef struct {
+  long start;
+  int depth;
+} sample_t;
+
+typedef struct {
+  int running;
+  long interval;
+  /* frames of all samples, leaf first */
+  VALUE *frames;
+  int *lines;
+  long frames_count;
+  long frames_capacity;
+  sample_t *samples;
+  long samples_count;
+  long samples_capacity;
+  long dropped;
+} sampler_t;
+
+static sampler_t sampler;
+static VALUE sampler_holder = Qnil;
+
+#ifdef DEBASE_SAMPLER
+static struct sigaction old_action;
+#ifdef DEBASE_POSTPONED_JOB_PREREGISTER
+static rb_postponed_job_handle_t sample_job_handle;
+#endif
+
+static void
+sample_job(void *data)
+{
+  long start;
+  int depth;
+
+  if (!sampler.running) return;
+  start = sampler.frames_count;
+  if (sampler.samples_count == sampler.samples_capacity ||
+    sampler.frames_capacity - start < MAX_SAMPLE_DEPTH) {
+    sampler.dropped++;
+    return;
+  }
+  depth = rb_profile_frames(0, MAX_SAMPLE_DEPTH, sampler.frames + start, sampler.lines + start);
+  if (depth <= 0) return;
+  sampler.frames_count += depth;
+  sampler.samples[sampler.samples_count].start = start;
+  sampler.samples[sampler.samples_count].depth = depth;
+  sampler.samples_count++;
+}
+
+static void
+sample_signal_handler(int signal)
+{
+#ifdef DEBASE_POSTPONED_JOB_PREREGISTER
+  rb_postponed_job_trigger(sample_job_handle);
+#else
+  rb_postponed_job_register_one(0, sample_job, NULL);
+#endif
+}
+
+static void
+set_timer(long interval)
+{
+  struct itimerval timer;
+
+  timer.it_interval.tv_sec = interval / 1000000;
+  timer.it_interval.tv_usec = interval % 1000000;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, NULL);
+}
+#endif
+
+static void
+sampler_mark(void *data)
+{
+  long i;
+
+  for (i = 0; i < sampler.frames_count; i++)
+    rb_gc_mark(sampler.frames[i]);
+}
+
+static void
+free_buffers()
+{
+  xfree(sampler.frames);
+  xfree(sampler.lines);
+  xfree(sampler.samples);
+  sampler.frames = NULL;
+  sampler.lines = NULL;
+  sampler.samples = NULL;
+  sampler.frames_capacity = 0;
+  sampler.samples_capacity = 0;
+  sampler.frames_count = 0;
+  sampler.samples_count = 0;
+}
+
+/*
+ *  call-seq:
+ *    Debase.start_sampler(interval_usec, max_samples)
+ *
+ *  Starts sampling stacks every interval_usec microseconds of CPU time.
+ *  Samples taken after max_samples are dropped. Previous samples are discarded.
+ */
+static VALUE
+Debase_start_sampler(VALUE self, VALUE interval, VALUE max_samples)
+{
+#ifdef DEBASE_SAMPLER
+  struct sigaction action;
+  long samples_capacity;
+
+  if (sampler.running)
+    rb_raise(rb_eRuntimeError, "sampling is already running");
+  sampler.interval = NUM2LONG(interval);
+  samples_capacity = NUM2LONG(max_samples);
+  if (sampler.interval <= 0 || samples_capacity <= 0)
+    rb_raise(rb_eArgError, "interval and max_samples must be positive");
+
+  free_buffers();
+  sampler.samples_capacity = samples_capacity;
+  sampler.samples = ALLOC_N(sample_t, samples_capacity);
+  /* stacks are usually much shallower than MAX_SAMPLE_DEPTH */
+  sampler.frames_capacity = samples_capacity * 32 + MAX_SAMPLE_DEPTH;
+  sampler.frames = ALLOC_N(VALUE, sampler.frames_capacity);
+  sampler.lines = ALLOC_N(int, sampler.frames_capacity);
+  sampler.dropped = 0;
+
+#ifdef DEBASE_POSTPONED_JOB_PREREGISTER
+  sample_job_handle = rb_postponed_job_preregister(0, sample_job, NULL);
+#endif
+  sampler.running = 1;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = sample_signal_handler;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, &old_action);
+  set_timer(sampler.interval);
+  return Qtrue;
+#else
+  rb_raise(rb_eNotImpError, "sampling is not supported on this platform");
+  return Qnil;
+#endif
+}
+
+/*
+ *  call-seq:
+ *    Debase.stop_sampler -> bool
+ *
+ *  Stops sampling, collected samples are kept until the next start.
+ */
+static VALUE
+Debase_stop_sampler(VALUE self)
+{
+#ifdef DEBASE_SAMPLER
+  if (!sampler.running) return Qfalse;
+  set_timer(0);
+  sigaction(SIGPROF, &old_action, NULL);
+  sampler.running = 0;
+  return Qtrue;
+#else
+  return Qfalse;
+#endif
+}
+
+/*
+ *  call-seq:
+ *    Debase.sampling? -> bool
+ *
+ *  Returns +true+ if the sampler is running.
+ */
+static VALUE
+Debase_sampling(VALUE self)
+{
+  return sampler.running ? Qtrue : Qfalse;
+}
+
+static VALUE
+frame_info(VALUE frame_infos, VALUE frame)
+{
+  VALUE info;
+  VALUE label;
+
+  info = rb_hash_lookup(frame_infos, frame);
+  if (info != Qnil) return info;
+  label = rb_profile_frame_full_label(frame);
+  info = rb_ary_new3(3,
+    NIL_P(label) ? rb_str_new2("(unknown)") : label,
+    rb_profile_frame_path(frame),
+    rb_profile_frame_first_lineno(frame));
+  rb_hash_aset(frame_infos, frame, info);
+  return info;
+}
+
+/*
+ *  call-seq:
+ *    Debase.sampled_stacks -> array
+ *
+ *  Returns collected samples as [stack, count] pairs, identical stacks are
+ *  merged. A stack is an array of [label, path, method_line, line] frames,
+ *  the innermost frame first.
+ */
+static VALUE
+Debase_sampled_stacks(VALUE self)
+{
+  VALUE counts;
+  VALUE frame_infos;
+  VALUE stack;
+  VALUE info;
+  VALUE count;
+  sample_t *sample;
+  long i;
+  long j;
+
+  counts = rb_hash_new();
+  frame_infos = rb_hash_new();
+  rb_funcall(frame_infos, rb_intern("compare_by_identity"), 0);
+  for (i = 0; i < sampler.samples_count; i++) {
+    sample = &sampler.samples[i];
+    stack = rb_ary_new2(sample->depth);
+    for (j = sample->start; j < sample->start + sample->depth; j++) {
+      info = rb_ary_dup(frame_info(frame_infos, sampler.frames[j]));
+      rb_ary_push(info, INT2FIX(sampler.lines[j]));
+      rb_ary_push(stack, info);
+    }
+    count = rb_hash_lookup(counts, stack);
+    rb_hash_aset(counts, stack, count == Qnil ? INT2FIX(1) : LONG2FIX(FIX2LONG(count) + 1));
+  }
+  return rb_funcall(counts, rb_intern("to_a"), 0);
+}
+
+/*
+ *  call-seq:
+ *    Debase.sampler_stats -> hash
+ *
+ *  Returns the sampling interval in microseconds and the numbers of
+ *  recorded and dropped samples.
+ */
+static VALUE
+Debase_sampler_stats(VALUE self)
+{
+  VALUE result;
+
+  result = rb_hash_new();
+  rb_hash_aset(result, ID2SYM(rb_intern("interval")), LONG2NUM(sampler.interval));
+  rb_hash_aset(result, ID2SYM(rb_intern("samples")), LONG2NUM(sampler.samples_count));
+  rb_hash_aset(result, ID2SYM(rb_intern("dropped")), LONG2NUM(sampler.dropped));
+  return result;
+}
+
+extern void
+Init_sampler(VALUE mDebase)
+{
+  /* keeps sampled frames alive */
+  sampler_holder = Data_Wrap_Struct(0, sampler_mark, 0, &sampler);
+  rb_global_variable(&sampler_holder);
+
+  rb_define_module_function(mDebase, "start_sampler", Debase_start_sampler, 2);
+  rb_define_module_function(mDebase, "stop_sampler", Debase_stop_sampler, 0);
+  rb_define_module_function(mDebase, "sampling?", Debase_sampling, 0);
+  rb_define_module_function(mDebase, "sampled_stacks", Debase_sampled_stacks, 0);
+  rb_define_module_function(mDebase, "sampler_stats", Debase_sampler_stats, 0);
+}
@@ -0,0 +1,134 @@
+#include <debase_internals.h>
+#include <signal.h>
+
+/* Starting the debugger on a signal. The signal handler only schedules a
+   postponed job, the job loads the configured start script at the next safe
+   point. Nothing is traced until then. The script runs once, later signals
+   are ignored until the start is installed again. */
+
+#ifndef _WIN32
+#define DEBASE_SIGNAL_START
+#endif
+
+static VALUE start_script = Qnil;
+
+#ifdef DEBASE_SIGNAL_START
+static int start_signal = 0;
+static volatile sig_atomic_t start_pending = 0;
+static struct sigaction old_action;
+#ifdef DEBASE_POSTPONED_JOB_PREREGISTER
+static rb_postponed_job_handle_t start_job_handle;
+#endif
+
+static VALUE
+load_start_script(VALUE script)
+{
+  rb_load(script, 0);
+  return Qnil;
+}
+
+static void
+start_job(void *data)
+{
+  VALUE script;
+  VALUE error;
+  int state;
+
+  if (!start_pending || start_script == Qnil) return;
+  start_pending = 0;
+  script = start_script;
+  start_script = Qnil;
+
+  rb_protect(load_start_script, script, &state);
+  if (state) {
+    error = rb_errinfo();
+    rb_set_errinfo(Qnil);
+    fprintf(stderr, "debase: start script %s failed: %s\n",
+      RSTRING_PTR(script), RSTRING_PTR(rb_inspect(error)));
+  }
+}
+
+static void
+start_signal_handler(int signal)
+{
+  if (start_script == Qnil || start_pending) return;
+  start_pending = 1;
+#ifdef DEBASE_POSTPONED_JOB_PREREGISTER
+  rb_postponed_job_trigger(start_job_handle);
+#else
+  rb_postponed_job_register_one(0, start_job, NULL);
+#endif
+}
+#endif
+
+/*
+ *  call-seq:
+ *    Debase.install_start_signal(signal_number, script)
+ *
+ *  Loads script when the process receives the signal. The script runs in
+ *  whichever Ruby thread next checks interrupts, not necessarily the one
+ *  interrupted by the signal, so it should only start a listener thread and
+ *  return.
+ */
+static VALUE
+Debase_install_start_signal(VALUE self, VALUE signal, VALUE script)
+{
+#ifdef DEBASE_SIGNAL_START
+  struct sigaction action;
+  int signo;
+
+  signo = NUM2INT(signal);
+  script = rb_str_new_frozen(StringValue(script));
+  if (start_signal != 0 && start_signal != signo)
+    rb_raise(rb_eRuntimeError, "start signal is already installed");
+
+#ifdef DEBASE_POSTPONED_JOB_PREREGISTER
+  start_job_handle = rb_postponed_job_preregister(0, start_job, NULL);
+#endif
+  start_script = script;
+  start_pending = 0;
+  if (start_signal == 0) {
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = start_signal_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(signo, &action, &old_action) != 0)
+      rb_sys_fail("sigaction");
+    start_signal = signo;
+  }
+  return Qtrue;
+#else
+  rb_raise(rb_eNotImpError, "start on signal is not supported on this platform");
+  return Qnil;
+#endif
+}
+
+/*
+ *  call-seq:
+ *    Debase.uninstall_start_signal -> bool
+ *
+ *  Restores the previous handler of the start signal.
+ */
+static VALUE
+Debase_uninstall_start_signal(VALUE self)
+{
+#ifdef DEBASE_SIGNAL_START
+  if (start_signal == 0) return Qfalse;
+  sigaction(start_signal, &old_action, NULL);
+  start_signal = 0;
+  start_script = Qnil;
+  start_pending = 0;
+  return Qtrue;
+#else
+  return Qfalse;
+#endif
+}
+
+extern void
+Init_signal_start(VALUE mDebase)
+{
+  rb_global_variable(&start_script);
+
+  rb_define_module_function(mDebase, "install_start_signal", Debase_install_start_signal, 2);
+  rb_define_module_function(mDebase, "uninstall_start_signal", Debase_uninstall_start_signal, 0);
+}
@@ -0,0 +1,268 @@
+#include <debase_internals.h>
+#include <ruby/encoding.h>
+#include <stdio.h>
+
+/* Serializes the state of a stopped thread into a single JSON string, so
+   the IDE backend does not need a Ruby call per frame and per variable.
+   The JSON is written directly into the result string, only inspect of
+   non-trivial values allocates. */
+
+/* collections with more elements are not inspected, only their size is shown */
+#define SNAPSHOT_MAX_ELEMENTS 100
+#define SNAPSHOT_DEFAULT_INSPECT_LENGTH 128
+
+static ID idLocalVariables;
+static ID idLocalVariableGet;
+static ID idName;
+
+static void
+json_raw(VALUE buffer, const char *ptr)
+{
+  rb_str_cat(buffer, ptr, strlen(ptr));
+}
+
+/* writes ptr as a JSON string, bytes of non UTF-8 strings above ASCII are replaced */
+static void
+json_bytes(VALUE buffer, const char *ptr, long len, int utf8, int truncated)
+{
+  char escape[8];
+  long run;
+  long i;
+  unsigned char c;
+
+  rb_str_cat(buffer, "\"", 1);
+  run = 0;
+  for (i = 0; i < len; i++) {
+    c = (unsigned char)ptr[i];
+    if (c >= 0x20 && c != '"' && c != '\\' && (c < 0x80 || utf8)) continue;
+
+    rb_str_cat(buffer, ptr + run, i - run);
+    run = i + 1;
+    switch (c) {
+      case '"': json_raw(buffer, "\\\""); break;
+      case '\\': json_raw(buffer, "\\\\"); break;
+      case '\n': json_raw(buffer, "\\n"); break;
+      case '\r': json_raw(buffer, "\\r"); break;
+      case '\t': json_raw(buffer, "\\t"); break;
+      default:
+        if (c >= 0x80) {
+          json_raw(buffer, "\\ufffd");
+        } else {
+          snprintf(escape, sizeof(escape), "\\u%04x", c);
+          json_raw(buffer, escape);
+        }
+    }
+  }
+  rb_str_cat(buffer, ptr + run, len - run);
+  if (truncated)
+    json_raw(buffer, "...");
+  rb_str_cat(buffer, "\"", 1);
+}
+
+static void
+json_cstr(VALUE buffer, const char *ptr)
+{
+  json_bytes(buffer, ptr, strlen(ptr), 1, 0);
+}
+
+/* writes at most max_length bytes of the string, not splitting UTF-8 characters */
+static void
+json_string(VALUE buffer, VALUE string, long max_length)
+{
+  const char *ptr;
+  long len;
+  int encindex;
+  int utf8;
+
+  if (NIL_P(string)) {
+    json_raw(buffer, "null");
+    return;
+  }
+  ptr = RSTRING_PTR(string);
+  len = RSTRING_LEN(string);
+  encindex = rb_enc_get_index(string);
+  utf8 = (encindex == rb_utf8_encindex() || encindex == rb_usascii_encindex()) &&
+    rb_enc_str_coderange(string) != ENC_CODERANGE_BROKEN;
+  if (max_length < 0 || len <= max_length) {
+    json_bytes(buffer, ptr, len, utf8, 0);
+    return;
+  }
+  len = max_length;
+  while (utf8 && len > 0 && ((unsigned char)ptr[len] & 0xc0) == 0x80)
+    len--;
+  json_bytes(buffer, ptr, len, utf8, 1);
+}
+
+static void
+json_int(VALUE buffer, long value)
+{
+  char number[32];
+
+  snprintf(number, sizeof(number), "%ld", value);
+  json_raw(buffer, number);
+}
+
+static VALUE
+inspect_value(VALUE value)
+{
+  return rb_inspect(value);
+}
+
+/* writes a truncated inspect string, immediates and large collections are formatted natively */
+static void
+json_inspect(VALUE buffer, VALUE value, long max_length)
+{
+  char summary[256];
+  VALUE inspected;
+  int state;
+
+  switch (TYPE(value)) {
+    case T_NIL:
+      json_raw(buffer, "\"nil\"");
+      return;
+    case T_TRUE:
+      json_raw(buffer, "\"true\"");
+      return;
+    case T_FALSE:
+      json_raw(buffer, "\"false\"");
+      return;
+    case T_FIXNUM:
+      rb_str_cat(buffer, "\"", 1);
+      json_int(buffer, FIX2LONG(value));
+      rb_str_cat(buffer, "\"", 1);
+      return;
+    case T_ARRAY:
+      if (RARRAY_LEN(value) <= SNAPSHOT_MAX_ELEMENTS) break;
+      snprintf(summary, sizeof(summary), "#<%s: %ld elements>", rb_obj_classname(value), RARRAY_LEN(value));
+      json_cstr(buffer, summary);
+      return;
+    case T_HASH:
+      if (RHASH_SIZE(value) <= SNAPSHOT_MAX_ELEMENTS) break;
+      snprintf(summary, sizeof(summary), "#<%s: %ld elements>", rb_obj_classname(value), (long)RHASH_SIZE(value));
+      json_cstr(buffer, summary);
+      return;
+  }
+
+  inspected = rb_protect(inspect_value, value, &state);
+  if (state) {
+    rb_set_errinfo(Qnil);
+    snprintf(summary, sizeof(summary), "#<%s: inspect failed>", rb_obj_classname(value));
+    json_cstr(buffer, summary);
+    return;
+  }
+  json_string(buffer, inspected, max_length);
+}
+
+static void
+json_frames(VALUE buffer, debug_context_t *context, int count)
+{
+  debug_frame_t *frame;
+  VALUE klass;
+  int i;
+
+  json_raw(buffer, "[");
+  for (i = 0; i < count; i++) {
+    frame = &context->frames[i];
+    if (i > 0) json_raw(buffer, ",");
+    json_raw(buffer, "{\"file\":");
+    json_string(buffer, frame_path(context, frame), -1);
+    json_raw(buffer, ",\"line\":");
+    json_int(buffer, frame_line(context, frame));
+    json_raw(buffer, ",\"method\":");
+    json_string(buffer, frame_label(context, frame), -1);
+    json_raw(buffer, ",\"class\":");
+    klass = frame_class(context, frame);
+    if (NIL_P(klass)) {
+      json_raw(buffer, "null");
+    } else {
+      json_cstr(buffer, rb_class2name(klass));
+    }
+    json_raw(buffer, "}");
+  }
+  json_raw(buffer, "]");
+}
+
+static void
+json_locals(VALUE buffer, debug_context_t *context, long max_length)
+{
+  VALUE binding;
+  VALUE names;
+  VALUE name;
+  VALUE value;
+  long i;
+
+  json_raw(buffer, "[");
+  binding = context->stack_size > 0 ? frame_binding(context, &context->frames[0]) : Qnil;
+  if (binding != Qnil) {
+    names = rb_funcall(binding, idLocalVariables, 0);
+    for (i = 0; i < RARRAY_LEN(names); i++) {
+      name = RARRAY_AREF(names, i);
+      value = rb_funcall(binding, idLocalVariableGet, 1, name);
+      if (i > 0) json_raw(buffer, ",");
+      json_raw(buffer, "{\"name\":");
+      json_string(buffer, rb_sym2str(name), -1);
+      json_raw(buffer, ",\"class\":");
+      json_cstr(buffer, rb_obj_classname(value));
+      json_raw(buffer, ",\"value\":");
+      json_inspect(buffer, value, max_length);
+      json_raw(buffer, "}");
+    }
+  }
+  json_raw(buffer, "]");
+}
+
+/*
+ *  call-seq:
+ *    context.snapshot(max_frames = stack_size, max_inspect = 128) -> string
+ *
+ *  Returns the thread, stop reason, frames and the locals of the top frame
+ *  as a JSON string. Inspect strings of locals are truncated to max_inspect
+ *  bytes. Locals are only available while the thread is stopped.
+ */
+static VALUE
+Context_snapshot(int argc, VALUE *argv, VALUE self)
+{
+  debug_context_t *context;
+  VALUE max_frames_value;
+  VALUE max_inspect_value;
+  VALUE buffer;
+  int max_frames;
+  long max_inspect;
+
+  Data_Get_Struct(self, debug_context_t, context);
+  rb_scan_args(argc, argv, "02", &max_frames_value, &max_inspect_value);
+  max_frames = NIL_P(max_frames_value) ? context->stack_size : FIX2INT(max_frames_value);
+  if (max_frames < 0 || max_frames > context->stack_size) max_frames = context->stack_size;
+  max_inspect = NIL_P(max_inspect_value) ? SNAPSHOT_DEFAULT_INSPECT_LENGTH : NUM2LONG(max_inspect_value);
+
+  buffer = rb_str_buf_new(1024);
+  rb_enc_associate(buffer, rb_utf8_encoding());
+
+  json_raw(buffer, "{\"thread\":{\"thnum\":");
+  json_int(buffer, context->thnum);
+  json_raw(buffer, ",\"name\":");
+  json_string(buffer, rb_funcall(context->thread, idName, 0), -1);
+  json_raw(buffer, "},\"stop_reason\":");
+  json_cstr(buffer, stop_reason_name(context));
+  json_raw(buffer, ",\"stack_size\":");
+  json_int(buffer, context->stack_size);
+  json_raw(buffer, ",\"frames\":");
+  json_frames(buffer, context, max_frames);
+  json_raw(buffer, ",\"locals\":");
+  json_locals(buffer, context, max_inspect);
+  json_raw(buffer, "}");
+  return buffer;
+}
+
+extern void
+Init_snapshot(VALUE mDebase)
+{
+  VALUE cContext;
+
+  idLocalVariables = rb_intern("local_variables");
+  idLocalVariableGet = rb_intern("local_variable_get");
+  idName = rb_intern("name");
+
+  cContext = rb_const_get(mDebase, rb_intern("Context"));
+  rb_define_method(cContext, "snapshot", Context_snapshot, -1);
+}
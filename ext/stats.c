@@ -0,0 +1,108 @@
+#include <debase_internals.h>
+
+/* Event handler statistics. Every measured operation adds to its counter,
+   its total time and a histogram of log2 scaled durations. The time a thread
+   spends stopped in the debugger or waiting for the locker is not counted to
+   its own handler latencies, stops of other threads do not affect them. */
+
+static const char *stat_names[STAT_KINDS] = {
+  "line_event",
+  "call_event",
+  "return_event",
+  "raise_event",
+  "breakpoint_check",
+  "condition_eval",
+  "locker_wait"
+};
+
+static debug_stat_t stats[STAT_KINDS];
+
+static inline int
+histogram_bucket(uint64_t duration)
+{
+  int bucket;
+
+#ifdef __GNUC__
+  bucket = duration > 1 ? 63 - __builtin_clzll(duration) : 0;
+#else
+  for (bucket = 0; duration > 1; bucket++)
+    duration >>= 1;
+#endif
+  return bucket < STAT_HISTOGRAM_SIZE ? bucket : STAT_HISTOGRAM_SIZE - 1;
+}
+
+extern void
+stats_record(stat_kind_t kind, stats_timer_t *timer)
+{
+  uint64_t paused;
+  uint64_t duration;
+  debug_stat_t *stat;
+
+  duration = monotonic_ns() - timer->start;
+  paused = timer->stopped_ns != NULL ? *timer->stopped_ns - timer->stopped : 0;
+  duration = duration > paused ? duration - paused : 0;
+
+  stat = &stats[kind];
+  stat->count++;
+  stat->total_ns += duration;
+  stat->histogram[histogram_bucket(duration)]++;
+}
+
+/* adds the time since the timer started to the stopped time of a thread */
+extern void
+stats_record_stop(stats_timer_t *timer, uint64_t *stopped_ns)
+{
+  *stopped_ns += monotonic_ns() - timer->start;
+}
+
+/*
+ *  call-seq:
+ *    Debase.stats -> hash
+ *
+ *  Returns counters of event handlers, breakpoint checks, condition
+ *  evaluations and locker waits. Each entry has :count, :total_ns and
+ *  :histogram, where histogram[i] is the number of durations in the
+ *  [2**i, 2**(i+1)) nanoseconds range, the last bucket counts all longer ones.
+ */
+static VALUE
+Debase_stats(VALUE self)
+{
+  VALUE result;
+  VALUE entry;
+  VALUE histogram;
+  int i;
+  int j;
+
+  result = rb_hash_new();
+  for (i = 0; i < STAT_KINDS; i++) {
+    histogram = rb_ary_new2(STAT_HISTOGRAM_SIZE);
+    for (j = 0; j < STAT_HISTOGRAM_SIZE; j++)
+      rb_ary_push(histogram, ULL2NUM(stats[i].histogram[j]));
+    entry = rb_hash_new();
+    rb_hash_aset(entry, ID2SYM(rb_intern("count")), ULL2NUM(stats[i].count));
+    rb_hash_aset(entry, ID2SYM(rb_intern("total_ns")), ULL2NUM(stats[i].total_ns));
+    rb_hash_aset(entry, ID2SYM(rb_intern("histogram")), histogram);
+    rb_hash_aset(result, ID2SYM(rb_intern(stat_names[i])), entry);
+  }
+  return result;
+}
+
+/*
+ *  call-seq:
+ *    Debase.reset_stats
+ *
+ *  Clears all counters returned by Debase.stats.
+ */
+static VALUE
+Debase_reset_stats(VALUE self)
+{
+  MEMZERO(stats, debug_stat_t, STAT_KINDS);
+  return Qnil;
+}
+
+extern void
+Init_stats(VALUE mDebase)
+{
+  rb_define_module_function(mDebase, "stats", Debase_stats, 0);
+  rb_define_module_function(mDebase, "reset_stats", Debase_reset_stats, 0);
+}
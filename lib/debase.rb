@@ -5,6 +5,8 @@ else
 end
 require "debase/version"
 require "debase/context"
+require "debase/sampling"
+require "debase/signal_start"
 
 module Debase
   class << self
@@ -16,7 +18,9 @@ module Debase
     # possibly deprecated options
     attr_accessor :keep_frame_binding, :tracing
 
+    # @param [Hash] options :non_stop stops only the thread which hit a breakpoint
     def start(options={}, &block)
+      self.non_stop = options[:non_stop] if options.key?(:non_stop)
       Debugger.const_set('ARGV', ARGV.clone) unless defined? Debugger::ARGV
       Debugger.const_set('PROG_SCRIPT', $0) unless defined? Debugger::PROG_SCRIPT
       Debugger.const_set('INITIAL_DIR', Dir.pwd) unless  defined? Debugger::INITIAL_DIR
@@ -32,6 +36,8 @@ module Debase
           super
           if mod.to_s.include?('Bootsnap') && RUBY_VERSION >= '2.5' && RUBY_VERSION < '2.6'
             prepend InstructionSequenceMixin
+          elsif mod.to_s.include?('Bootsnap') && RUBY_VERSION >= '2.6'
+            prepend InstructionSequenceRegistry
           end
         end
       end
@@ -40,17 +46,58 @@ module Debase
     # @param [String] file
     # @param [Fixnum] line
     # @param [String] expr
-    def add_breakpoint(file, line, expr=nil)
+    # @param [Hash] options :hit_condition (:greater_or_equal, :equal or :modulo),
+    #   :hit_value and :thread (Thread or context thnum) the breakpoint stops
+    def add_breakpoint(file, line, expr=nil, options={})
+      add_breakpoint_object(Breakpoint.new(file, line, expr), options)
+    end
+
+    # Adds a breakpoint which does not stop but buffers the message,
+    # {expr} parts of the message are evaluated in the frame.
+    # @param [String] message
+    def add_logpoint(file, line, message, expr=nil, options={})
       breakpoint = Breakpoint.new(file, line, expr)
-      breakpoints << breakpoint
-      enable_trace_points
-      breakpoint
+      breakpoint.log_message = message
+      add_breakpoint_object(breakpoint, options)
+    end
+
+    # Writes logpoint messages to io from a debugger thread, nil stops writing
+    def logpoint_sink=(io)
+      @logpoint_flusher.kill if @logpoint_flusher
+      @logpoint_flusher = io && DebugThread.new do
+        loop do
+          sleep 0.1
+          messages = flush_logpoints
+          next if messages.empty?
+          io.write(messages.join("\n") << "\n")
+          io.flush
+        end
+      end
     end
 
     def remove_breakpoint(id)
       Breakpoint.remove breakpoints, id
     end
 
+    def add_breakpoint_object(breakpoint, options)
+      breakpoint.hit_condition = options[:hit_condition]
+      breakpoint.hit_value = options[:hit_value] || 0
+      breakpoint.thread = breakpoint_thread(options[:thread])
+      Breakpoint.add breakpoints, breakpoint
+      # targeted breakpoints enable line events only for iseqs of their files
+      enable_trace_points unless breakpoint.targeted?
+      breakpoint
+    end
+    private :add_breakpoint_object
+
+    def breakpoint_thread(thread)
+      return thread unless thread.is_a?(Integer)
+      context = contexts.find { |c| c.thnum == thread }
+      raise ArgumentError, "Unknown thread #{thread}" unless context
+      context.thread
+    end
+    private :breakpoint_thread
+
     def source_reload; {} end
 
     def post_mortem?
@@ -61,17 +108,24 @@ module Debase
       false
     end
 
-    def add_catchpoint(exception)
+    # @param [String] exception
+    # @param [Hash] options :exact stops only on the class itself, not its subclasses,
+    #   :message stops only if the exception message contains the string
+    def add_catchpoint(exception, options={})
       catchpoints[exception] = 0
+      set_catchpoint_options(exception, options[:exact], options[:message])
       enable_trace_points
     end
 
     def remove_catchpoint(exception)
       catchpoints.delete(exception)
+      set_catchpoint_options(exception, false, nil)
     end
 
     def clear_catchpoints
+      catchpoints.keys.each { |exception| set_catchpoint_options(exception, false, nil) }
       catchpoints.clear
+      invalidate_catchpoints
     end
 
     #call-seq:
@@ -110,44 +164,14 @@ module Debase
         iseq.each_child { |child_iseq| do_set_flags(child_iseq) } if iseq.respond_to? :each_child
       end
     end
-  end
-
-  class FileFilter
-    def initialize
-      @enabled = false
-    end
-
-    def include(file_path)
-      included << file_path unless excluded.delete(file_path)
-    end
-
-    def exclude(file_path)
-      excluded << file_path unless included.delete(file_path)
-    end
-
-    def enable
-      @enabled = true
-      Debase.enable_file_filtering(@enabled);
-    end
-
-    def disable
-      @enabled = false
-      Debase.enable_file_filtering(@enabled);
-    end
 
-    def accept?(file_path)
-      return true unless @enabled
-      return false if file_path.nil?
-      included.any? { |path| file_path.start_with?(path) } && excluded.all? { |path| !file_path.start_with?(path)}
-    end
-
-    private
-    def included
-      @included ||= []
-    end
-
-    def excluded
-      @excluded ||= []
+    # iseqs loaded from cache do not emit script_compiled event
+    module InstructionSequenceRegistry
+      def load_iseq(path)
+        iseq = super(path)
+        Debugger.register_iseq(iseq) if iseq
+        iseq
+      end
     end
   end
 
@@ -0,0 +1,126 @@
+require 'zlib'
+require 'stringio'
+
+module Debase
+  class << self
+    # Starts the sampling profiler, it does not enable any TracePoint.
+    # @param [Float] interval seconds of CPU time between samples
+    # @param [Integer] max_samples samples taken after this number are dropped
+    def start_sampling(interval: 0.001, max_samples: 100_000)
+      start_sampler((interval * 1_000_000).round, max_samples)
+    end
+
+    def stop_sampling
+      stop_sampler
+    end
+
+    # Returns samples in folded stacks format (one "outer;inner count" line per stack)
+    # as used by flamegraph.pl and speedscope.
+    def sampled_folded_stacks
+      sampled_stacks.map do |stack, count|
+        "#{stack.reverse.map { |frame| frame[0] }.join(';')} #{count}\n"
+      end.join
+    end
+
+    # Returns samples as a gzipped pprof profile.proto message.
+    def sampled_pprof
+      Sampling::PprofWriter.new(sampled_stacks, sampler_stats[:interval]).write
+    end
+  end
+
+  module Sampling
+    # Minimal protobuf encoder for the pprof profile format,
+    # see https://github.com/google/pprof/blob/main/proto/profile.proto
+    class PprofWriter
+      def initialize(stacks, interval)
+        @stacks = stacks
+        @interval_ns = interval * 1000
+        @strings = {'' => 0}
+        @functions = {}
+        @locations = {}
+      end
+
+      def write
+        samples = @stacks.map do |stack, count|
+          ids = stack.map { |frame| location_id(frame) }
+          packed(1, ids) + packed(2, [count, count * @interval_ns])
+        end
+
+        profile = String.new(encoding: Encoding::BINARY)
+        profile << field(1, value_type('samples', 'count'))
+        profile << field(1, value_type('cpu', 'nanoseconds'))
+        samples.each { |sample| profile << field(2, sample) }
+        @locations.each_value { |location| profile << field(4, location[1]) }
+        @functions.each_value { |function| profile << field(5, function[1]) }
+        @strings.each_key { |string| profile << field(6, string.b) }
+        profile << field(11, value_type('cpu', 'nanoseconds'))
+        profile << tag(12, 0) << varint(@interval_ns)
+
+        io = StringIO.new(String.new(encoding: Encoding::BINARY))
+        gz = Zlib::GzipWriter.new(io)
+        gz.write(profile)
+        gz.close
+        io.string
+      end
+
+      private
+
+      def location_id(frame)
+        label, path, method_line, line = frame
+        location = @locations[frame] ||= begin
+          id = @locations.size + 1
+          line_message = int_field(1, function_id(label, path, method_line)) + int_field(2, line)
+          [id, int_field(1, id) + field(4, line_message)]
+        end
+        location[0]
+      end
+
+      def function_id(label, path, method_line)
+        key = [label, path, method_line]
+        function = @functions[key] ||= begin
+          id = @functions.size + 1
+          [id, int_field(1, id) + int_field(2, string_id(label)) + int_field(3, string_id(label)) +
+            int_field(4, string_id(path.to_s)) + int_field(5, method_line.to_i)]
+        end
+        function[0]
+      end
+
+      def string_id(string)
+        @strings[string] ||= @strings.size
+      end
+
+      def value_type(type, unit)
+        int_field(1, string_id(type)) + int_field(2, string_id(unit))
+      end
+
+      def packed(number, values)
+        field(number, values.map { |value| varint(value) }.join)
+      end
+
+      def field(number, bytes)
+        tag(number, 2) + varint(bytes.bytesize) + bytes
+      end
+
+      def int_field(number, value)
+        tag(number, 0) + varint(value)
+      end
+
+      def tag(number, wire_type)
+        varint((number << 3) | wire_type)
+      end
+
+      def varint(value)
+        bytes = String.new(encoding: Encoding::BINARY)
+        loop do
+          byte = value & 0x7f
+          value >>= 7
+          if value == 0
+            bytes << byte
+            return bytes
+          end
+          bytes << (byte | 0x80)
+        end
+      end
+    end
+  end
+end
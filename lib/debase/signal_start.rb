@@ -0,0 +1,22 @@
+module Debase
+  class << self
+    # Loads script when the process receives the signal, nothing is traced before.
+    # The script usually starts a debugger listener in a DebugThread.
+    # @param [String] script path of the script to load
+    # @param [String, Integer] signal signal name or number
+    def start_on_signal(script, signal: 'USR2')
+      signo = signal.is_a?(Integer) ? signal : Signal.list[signal.to_s.sub(/\ASIG/, '')]
+      raise ArgumentError, "Unknown signal #{signal}" unless signo
+      install_start_signal(signo, File.expand_path(script))
+    end
+
+    def cancel_start_on_signal
+      uninstall_start_signal
+    end
+  end
+end
+
+# DEBASE_START_SCRIPT=script [DEBASE_START_SIGNAL=USR2] enables the start on signal when debase is loaded
+if ENV['DEBASE_START_SCRIPT'] && !ENV['DEBASE_START_SCRIPT'].empty?
+  Debase.start_on_signal(ENV['DEBASE_START_SCRIPT'], signal: ENV['DEBASE_START_SIGNAL'] || 'USR2')
+end
@@ -0,0 +1,38 @@
+#!/usr/bin/env ruby
+require File.expand_path("helper", File.dirname(__FILE__))
+require "open3"
+
+# Test the attach entry point called by gdb/lldb.
+class TestAttach < Test::Unit::TestCase
+  ATTACH_LIB = File.expand_path("../ext/attach/attach.#{RbConfig::CONFIG['DLEXT']}", File.dirname(__FILE__))
+
+  # The attach is requested from a thread which then blocks in C code,
+  # no line event happens until the safe point is reached.
+  ATTACH_SCRIPT = <<-'RUBY'
+    require "fiddle"
+    lib = Fiddle.dlopen(ARGV[0])
+    start_attach = Fiddle::Function.new(lib["debase_start_attach"], [], Fiddle::TYPE_INT)
+    hits = Fiddle::Function.new(lib["debase_attach_test_hits"], [], Fiddle::TYPE_INT)
+    reader, _writer = IO.pipe
+    started = nil
+    Thread.new do
+      started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      start_attach.call
+      IO.select([reader], nil, nil, 10)
+    end
+    sleep 0.001 while hits.call == 0 &&
+      (started.nil? || Process.clock_gettime(Process::CLOCK_MONOTONIC) - started < 5)
+    puts Process.clock_gettime(Process::CLOCK_MONOTONIC) - started
+    puts hits.call
+  RUBY
+
+  def test_attach_latency
+    omit_if(Gem.win_platform?)
+    omit_unless(File.exist?(ATTACH_LIB), "attach library is not built")
+    output, status = Open3.capture2(Gem.ruby, "-e", ATTACH_SCRIPT, ATTACH_LIB)
+    assert_true(status.success?)
+    latency, hits = output.split("\n")
+    assert_equal("1", hits)
+    assert_operator(latency.to_f, :<, 1.0)
+  end
+end
@@ -34,6 +34,18 @@ class TestRubyDebug < Test::Unit::TestCase
                  'Debugger should no longer be started.')
   end
 
+  def test_thread_contexts
+    Debugger.start_
+    context = Debugger.current_context
+    assert_same(context, Debugger.current_context)
+    thread_context = Thread.new { Debugger.current_context }.value
+    assert_not_same(context, thread_context)
+    assert_equal(true, Debugger.contexts.include?(context))
+    assert_equal(false, Debugger.contexts.include?(thread_context))
+  ensure
+    Debugger.stop
+  end
+
   # Test initial variables and setting/getting state.
   def test_debugger_base
     assert_equal(false, Debugger.started?, 
@@ -58,6 +70,182 @@ class TestRubyDebug < Test::Unit::TestCase
                  'debugger should no longer be started.')
   end
 
+  def test_lazy_stack_depth
+    Debugger.start_
+    assert_equal(false, Debugger.lazy_stack_depth?)
+    Debugger.lazy_stack_depth = true
+    Debugger.add_breakpoint(__FILE__, 1)
+    assert_equal(true, Debugger.lazy_stack_depth?)
+    assert_equal(false, Debugger.current_context.dead?)
+  ensure
+    Debugger.lazy_stack_depth = false
+    Debugger.stop
+  end
+
+  def test_context_released_at_thread_end
+    Debugger.start_
+    size = Debugger.contexts_size
+    thread = Thread.new { Debugger.current_context; Thread.stop }
+    sleep 0.01 until thread.stop?
+    assert_equal(size + 1, Debugger.contexts_size)
+    thread.wakeup
+    thread.join
+    # removed by the thread_end event, not by the Debugger.contexts sweep
+    assert_equal(size, Debugger.contexts_size)
+  ensure
+    Debugger.stop
+  end
+
+  def test_context_after_compaction
+    omit_unless(GC.respond_to?(:compact))
+    Debugger.start_
+    context = Debugger.current_context
+    if GC.respond_to?(:verify_compaction_references)
+      GC.verify_compaction_references(expand_heap: true, toward: :empty)
+    else
+      GC.compact
+    end
+    assert_same(context, Debugger.current_context)
+    assert_equal(false, Debugger.current_context.dead?)
+  ensure
+    Debugger.stop
+  end
+
+  def test_active_events
+    Debugger.start_
+    Debugger.breakpoints.clear
+    assert_equal([], Debugger.active_events)
+    Debugger.add_catchpoint('ZeroDivisionError')
+    assert_equal([:raise], Debugger.active_events)
+    Debugger.add_breakpoint("foo.rb", 11)
+    assert_equal([:line, :raise], Debugger.active_events)
+    Debugger.clear_catchpoints
+    Debugger.enable_trace_points
+    assert_equal([:line], Debugger.active_events)
+  ensure
+    Debugger.stop
+  end
+
+  class AllStopHandler
+    attr_reader :worker_advanced
+
+    def initialize(counter)
+      @counter = counter
+      @worker_advanced = []
+    end
+
+    def at_breakpoint(context, breakpoint); end
+
+    def at_line(context, file, line)
+      # the worker stops at its next line
+      sleep 0.05
+      start = @counter[0]
+      sleep 0.2
+      @worker_advanced << (@counter[0] != start)
+      context.step(1) if @worker_advanced.size == 1
+    end
+  end
+
+  def all_stop_method
+    a = 1
+    a + 1
+  end
+
+  def test_all_stop_while_stepping
+    counter = [0]
+    handler = AllStopHandler.new(counter)
+    Debugger.handler = handler
+    Debugger.start_
+    Debugger.breakpoints.clear
+    worker = Thread.new { loop { counter[0] += 1; sleep 0.001 } }
+    sleep 0.01
+    Debugger.add_breakpoint(__FILE__, method(:all_stop_method).source_location[1] + 1)
+    all_stop_method
+    assert_equal([false, false], handler.worker_advanced)
+  ensure
+    worker.kill if worker
+    Debugger.handler = nil
+    Debugger.stop
+  end
+
+  class NonStopHandler
+    attr_reader :worker_ran, :stopped
+
+    def initialize(counter)
+      @counter = counter
+    end
+
+    def at_breakpoint(context, breakpoint)
+    end
+
+    def at_line(context, file, line)
+      @stopped = context.stopped?
+      start = @counter[0]
+      deadline = Time.now + 5
+      sleep 0.01 while @counter[0] == start && Time.now < deadline
+      @worker_ran = @counter[0] != start
+    end
+  end
+
+  def test_non_stop
+    counter = [0]
+    handler = NonStopHandler.new(counter)
+    Debugger.handler = handler
+    Debugger.non_stop = true
+    Debugger.start_
+    Debugger.breakpoints.clear
+    worker = Thread.new { loop { counter[0] += 1; sleep 0.001 } }
+    Debugger.add_breakpoint(__FILE__, method(:all_stop_method).source_location[1] + 1)
+    all_stop_method
+    assert_equal(true, handler.stopped)
+    assert_equal(true, handler.worker_ran)
+    assert_equal(false, Debugger.current_context.stopped?)
+  ensure
+    worker.kill if worker
+    Debugger.non_stop = false
+    Debugger.handler = nil
+    Debugger.stop
+  end
+
+  class PauseRecorder
+    attr_reader :stopped_threads
+
+    def initialize
+      @stopped_threads = []
+    end
+
+    def at_breakpoint(context, breakpoint); end
+
+    def at_line(context, file, line)
+      @stopped_threads << context.thread
+    end
+  end
+
+  def test_non_stop_keeps_pauses_of_other_threads
+    handler = PauseRecorder.new
+    Debugger.handler = handler
+    Debugger.non_stop = true
+    Debugger.start_
+    Debugger.breakpoints.clear
+    queue = Queue.new
+    worker = Thread.new do
+      queue.pop
+      all_stop_method
+    end
+    sleep 0.05
+    assert_equal(true, Debugger.contexts.find { |context| context.thread == worker }.pause)
+    Debugger.add_breakpoint(__FILE__, method(:locker_gate).source_location[1] + 1)
+    locker_gate
+    queue << 1
+    worker.join(5)
+    assert_equal([Thread.current, worker], handler.stopped_threads)
+  ensure
+    worker.kill if worker
+    Debugger.non_stop = false
+    Debugger.handler = nil
+    Debugger.stop
+  end
+
   # Test breakpoint handling
   def test_breakpoints
     Debugger.start_
@@ -77,5 +265,149 @@ class TestRubyDebug < Test::Unit::TestCase
   ensure
     Debugger.stop
   end
-end
 
+  def test_file_filter
+    filter = Debugger::FileFilter.new
+    assert_equal(true, filter.accept?("/app/lib/a.rb"))
+    filter.include("/app")
+    filter.exclude("/app/vendor")
+    filter.enable
+    assert_equal(true, filter.accept?("/app/lib/a.rb"))
+    assert_equal(false, filter.accept?("/app/vendor/b.rb"))
+    assert_equal(false, filter.accept?("/lib/c.rb"))
+    assert_equal(false, filter.accept?(nil))
+    filter.include("/app/vendor")
+    assert_equal(true, filter.accept?("/app/vendor/b.rb"))
+    filter.disable
+    assert_equal(true, filter.accept?("/lib/c.rb"))
+  end
+
+  def test_locker_stats
+    Debugger.start_
+    stats = Debugger.locker_stats
+    assert_equal([:waits, :wait_time, :handoffs, :queue_length, :max_queue_length], stats.keys)
+    assert_equal(0, stats[:queue_length])
+  ensure
+    Debugger.stop
+  end
+
+  class QueueHandler
+    attr_reader :order, :workers
+
+    def initialize(gate_line)
+      @gate_line = gate_line
+      @order = []
+      @workers = []
+    end
+
+    def at_breakpoint(context, breakpoint); end
+
+    def at_line(context, file, line)
+      if line == @gate_line
+        # the workers queue for the debugger lock in the order they are started
+        3.times do |i|
+          @workers << Thread.new(i) { |n| TestRubyDebug.queued_line(n) }
+          sleep 0.05
+        end
+      else
+        @order << context.frame_binding(0).local_variable_get(:n)
+      end
+    end
+  end
+
+  def self.queued_line(n)
+    n
+  end
+
+  def locker_gate
+    1
+  end
+
+  def test_locker_hands_off_in_order
+    gate_line = method(:locker_gate).source_location[1] + 1
+    handler = QueueHandler.new(gate_line)
+    Debugger.handler = handler
+    Debugger.start_
+    Debugger.breakpoints.clear
+    Debugger.add_breakpoint(__FILE__, gate_line)
+    Debugger.add_breakpoint(__FILE__, TestRubyDebug.method(:queued_line).source_location[1] + 1)
+    handoffs = Debugger.locker_stats[:handoffs]
+    Debugger.reset_stats
+    locker_gate
+    handler.workers.each(&:join)
+    assert_equal([0, 1, 2], handler.order)
+    assert_operator(Debugger.locker_stats[:handoffs] - handoffs, :>=, 3)
+    assert_operator(Debugger.locker_stats[:max_queue_length], :>=, 3)
+    # the workers wait while the gate thread is stopped
+    assert_operator(Debugger.stats[:locker_wait][:count], :>=, 3)
+    assert_operator(Debugger.stats[:locker_wait][:total_ns], :>=, 50_000_000)
+  ensure
+    Debugger.handler = nil
+    Debugger.stop
+  end
+
+  class RaiseInWaitHandler
+    attr_reader :order, :raised, :worker
+
+    def initialize(gate_line)
+      @gate_line = gate_line
+      @order = []
+    end
+
+    def at_breakpoint(context, breakpoint); end
+
+    def at_line(context, file, line)
+      if line == @gate_line
+        # the first waiter leaves the queue by an exception and stays alive
+        @raised = Thread.new do
+          begin
+            TestRubyDebug.queued_line(0)
+          rescue RuntimeError
+          end
+          sleep
+        end
+        sleep 0.01 until @raised.stop?
+        @raised.raise("timeout")
+        sleep 0.05
+        @worker = Thread.new { TestRubyDebug.queued_line(1) }
+        sleep 0.05
+      else
+        @order << context.frame_binding(0).local_variable_get(:n)
+      end
+    end
+  end
+
+  def test_locker_skips_waiter_left_by_exception
+    gate_line = method(:locker_gate).source_location[1] + 1
+    handler = RaiseInWaitHandler.new(gate_line)
+    Debugger.handler = handler
+    Debugger.start_
+    Debugger.breakpoints.clear
+    Debugger.add_breakpoint(__FILE__, gate_line)
+    Debugger.add_breakpoint(__FILE__, TestRubyDebug.method(:queued_line).source_location[1] + 1)
+    locker_gate
+    assert_not_nil(handler.worker.join(5))
+    assert_equal([1], handler.order)
+  ensure
+    handler.raised.kill if handler && handler.raised
+    Debugger.handler = nil
+    Debugger.stop
+  end
+
+  def test_stats
+    Debugger.start_
+    Debugger.breakpoints.clear
+    Debugger.add_breakpoint("foo.rb", 11)
+    Debugger.reset_stats
+    3.times { Debugger.started? }
+    stats = Debugger.stats
+    assert_operator(stats[:line_event][:count], :>, 0)
+    assert_equal(32, stats[:line_event][:histogram].size)
+    assert_equal(stats[:line_event][:count], stats[:line_event][:histogram].sum)
+    assert_equal(0, stats[:locker_wait][:count])
+    Debugger.reset_stats
+    assert_equal(0, Debugger.stats[:line_event][:count])
+  ensure
+    Debugger.stop
+  end
+end
@@ -1,5 +1,6 @@
 #!/usr/bin/env ruby
 require File.expand_path("helper", File.dirname(__FILE__))
+require "tmpdir"
 
 # Some tests of Debugger module in C extension ruby_debug
 class TestBreakpoints < Test::Unit::TestCase
@@ -11,6 +12,134 @@ class TestBreakpoints < Test::Unit::TestCase
     assert_nil(Debugger::Breakpoint.find(Debugger.breakpoints, "foo.rb", 10, nil))
   end
 
+  def test_find_after_remove
+    Debugger.start
+    Debugger.breakpoints.clear
+    first = Debugger.add_breakpoint("foo.rb", 11, nil)
+    second = Debugger.add_breakpoint("bar.rb", 11, nil)
+    Debugger.add_breakpoint("foo.rb", 12, nil)
+    assert_equal(first, Debugger::Breakpoint.find(Debugger.breakpoints, "foo.rb", 11, nil))
+    Debugger.remove_breakpoint(first.id)
+    assert_nil(Debugger::Breakpoint.find(Debugger.breakpoints, "foo.rb", 11, nil))
+    assert_equal(second, Debugger::Breakpoint.find(Debugger.breakpoints, "bar.rb", 11, nil))
+    assert_not_nil(Debugger::Breakpoint.find(Debugger.breakpoints, "foo.rb", 12, nil))
+  ensure
+    Debugger.stop
+  end
+
+  def test_find_in_modified_array
+    Debugger.start
+    Debugger.breakpoints.clear
+    Debugger.add_breakpoint("foo.rb", 11, nil)
+    Debugger.breakpoints << Debugger::Breakpoint.new("baz.rb", 20, nil)
+    assert_not_nil(Debugger::Breakpoint.find(Debugger.breakpoints, "baz.rb", 20, nil))
+    Debugger.breakpoints.clear
+    assert_nil(Debugger::Breakpoint.find(Debugger.breakpoints, "foo.rb", 11, nil))
+  ensure
+    Debugger.stop
+  end
+
+  def test_find_after_same_length_change
+    Debugger.start
+    Debugger.breakpoints.clear
+    first = Debugger.add_breakpoint("foo.rb", 11, nil)
+    assert_equal(first, Debugger::Breakpoint.find(Debugger.breakpoints, "foo.rb", 11, nil))
+    Debugger.breakpoints.delete(first)
+    second = Debugger::Breakpoint.new("bar.rb", 30, nil)
+    Debugger.breakpoints << second
+    assert_nil(Debugger::Breakpoint.find(Debugger.breakpoints, "foo.rb", 11, nil))
+    assert_equal(second, Debugger::Breakpoint.find(Debugger.breakpoints, "bar.rb", 30, nil))
+  ensure
+    Debugger.stop
+  end
+
+  def test_find_after_compaction
+    omit_unless(GC.respond_to?(:compact))
+    Debugger.start
+    Debugger.breakpoints.clear
+    breakpoint = Debugger.add_breakpoint("foo.rb", 11, nil)
+    assert_equal(breakpoint, Debugger::Breakpoint.find(Debugger.breakpoints, "foo.rb".freeze, 11, nil))
+    assert_nil(Debugger::Breakpoint.find(Debugger.breakpoints, "bar.rb".freeze, 11, nil))
+    GC.compact
+    assert_equal(breakpoint, Debugger::Breakpoint.find(Debugger.breakpoints, "foo.rb".freeze, 11, nil))
+    assert_nil(Debugger::Breakpoint.find(Debugger.breakpoints, "bar.rb".freeze, 11, nil))
+  ensure
+    Debugger.stop
+  end
+
+  def test_find_through_symlink_after_invalidate
+    omit_if(Gem.win_platform?)
+    Debugger.start
+    Debugger.breakpoints.clear
+    Dir.mktmpdir do |dir|
+      File.write(File.join(dir, "a.rb"), "")
+      File.write(File.join(dir, "b.rb"), "")
+      link = File.join(dir, "link.rb")
+      File.symlink(File.join(dir, "a.rb"), link)
+      Debugger.add_breakpoint("a.rb", 1, nil)
+      assert_not_nil(Debugger::Breakpoint.find(Debugger.breakpoints, link, 1, nil))
+
+      File.unlink(link)
+      File.symlink(File.join(dir, "b.rb"), link)
+      assert_equal(true, Debugger.invalidate_file(link))
+      assert_nil(Debugger::Breakpoint.find(Debugger.breakpoints, link, 1, nil))
+    end
+  ensure
+    Debugger.stop
+  end
+
+  def test_targeted_breakpoint
+    omit_if(RUBY_VERSION < '2.6')
+    Debugger.start
+    Debugger.breakpoints.clear
+    path = File.expand_path("example/gcd.rb", File.dirname(__FILE__))
+    Debugger.register_iseq(RubyVM::InstructionSequence.compile_file(path))
+    assert_equal(true, Debugger.add_breakpoint(path, 6).targeted?)
+    assert_equal(false, Debugger.add_breakpoint(path, 100).targeted?)
+    assert_equal(false, Debugger.add_breakpoint("other.rb", 6).targeted?)
+  ensure
+    Debugger.stop
+  end
+
+  class StopCounter
+    attr_reader :stops
+
+    def initialize
+      @stops = 0
+    end
+
+    def at_breakpoint(context, breakpoint); end
+
+    def at_line(context, file, line)
+      @stops += 1
+    end
+  end
+
+  def test_targeted_breakpoints_on_same_line
+    omit_if(RUBY_VERSION < '2.6')
+    counter = StopCounter.new
+    Debugger.handler = counter
+    Debugger.start
+    Debugger.breakpoints.clear
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "same_line.rb")
+      File.write(path, "x = 1\nx + 1\n")
+      iseq = RubyVM::InstructionSequence.compile_file(path)
+      Debugger.register_iseq(iseq)
+      first = Debugger.add_breakpoint(path, 2)
+      second = Debugger.add_breakpoint(path, 2)
+      assert_equal(true, first.targeted?)
+      assert_equal(true, second.targeted?)
+      iseq.eval
+      assert_equal(1, counter.stops)
+      assert_equal(1, first.hit_count)
+      assert_equal(0, second.hit_count)
+    end
+  ensure
+    Debugger.handler = nil
+    Debugger.stop
+  end
+
   def test_conditional_true_expression
     Debugger.start
     Debugger.add_breakpoint("foo.rb", 11, "[1, 2, 3].length == 3")
@@ -31,4 +160,140 @@ class TestBreakpoints < Test::Unit::TestCase
     assert_nil(Debugger::Breakpoint.find(Debugger.breakpoints, "foo.rb", 11, nil))
     Debugger.stop
   end
-end
\ No newline at end of file
+
+  def test_conditional_syntax_error
+    Debugger.start
+    Debugger.breakpoints.clear
+    breakpoint = Debugger.add_breakpoint("foo.rb", 11, "1 +* 2")
+    assert_not_nil(breakpoint.expr_error)
+    assert_nil(Debugger::Breakpoint.find(Debugger.breakpoints, "foo.rb", 11, nil))
+    breakpoint.expr = "1 + 2 == 3"
+    assert_nil(breakpoint.expr_error)
+    assert_equal(breakpoint, Debugger::Breakpoint.find(Debugger.breakpoints, "foo.rb", 11, nil))
+  ensure
+    Debugger.stop
+  end
+
+  def test_conditional_expression_is_reevaluated
+    Debugger.start
+    Debugger.breakpoints.clear
+    $debase_condition_hits = 0
+    Debugger.add_breakpoint("foo.rb", 11, "($debase_condition_hits += 1) > 1")
+    assert_nil(Debugger::Breakpoint.find(Debugger.breakpoints, "foo.rb", 11, nil))
+    assert_not_nil(Debugger::Breakpoint.find(Debugger.breakpoints, "foo.rb", 11, nil))
+    assert_equal(2, $debase_condition_hits)
+  ensure
+    Debugger.stop
+  end
+
+  def test_side_effecting_condition_runs_once
+    Debugger.start
+    Debugger.breakpoints.clear
+    $debase_condition_log = []
+    Debugger.add_breakpoint("foo.rb", 11, "$debase_condition_log << 1; debase_undefined_name")
+    assert_nil(Debugger::Breakpoint.find(Debugger.breakpoints, "foo.rb", 11, nil))
+    assert_equal(1, $debase_condition_log.size)
+    assert_nil(Debugger::Breakpoint.find(Debugger.breakpoints, "foo.rb", 11, nil))
+    assert_equal(2, $debase_condition_log.size)
+
+    $debase_condition_hits = 0
+    Debugger.add_breakpoint("foo.rb", 12, "$debase_condition_hits += 1; DebaseUndefinedConstant::X == $debase_condition_hits")
+    assert_nil(Debugger::Breakpoint.find(Debugger.breakpoints, "foo.rb", 12, nil))
+    assert_equal(1, $debase_condition_hits)
+  ensure
+    Debugger.stop
+  end
+
+  class NullHandler
+    def at_breakpoint(context, breakpoint); end
+    def at_line(context, file, line); end
+  end
+
+  def conditioned_method(value)
+    value * 2
+  end
+
+  def test_condition_assigns_frame_local
+    Debugger.handler = NullHandler.new
+    Debugger.start
+    Debugger.breakpoints.clear
+    Debugger.add_breakpoint(__FILE__, method(:conditioned_method).source_location[1] + 1, "(value = 5) > 0")
+    assert_equal(10, conditioned_method(1))
+  ensure
+    Debugger.handler = nil
+    Debugger.stop
+  end
+
+  CONDITION_VALUE = 3
+
+  def test_condition_resolves_class_constant
+    counter = StopCounter.new
+    Debugger.handler = counter
+    Debugger.start
+    Debugger.breakpoints.clear
+    Debugger.add_breakpoint(__FILE__, method(:conditioned_method).source_location[1] + 1, "value == CONDITION_VALUE")
+    conditioned_method(1)
+    conditioned_method(CONDITION_VALUE)
+    assert_equal(1, counter.stops)
+  ensure
+    Debugger.handler = nil
+    Debugger.stop
+  end
+
+  def test_hit_condition
+    Debugger.start
+    Debugger.breakpoints.clear
+    breakpoint = Debugger.add_breakpoint("foo.rb", 11, nil, :hit_condition => :modulo, :hit_value => 3)
+    hits = (1..6).map { Debugger::Breakpoint.find(Debugger.breakpoints, "foo.rb", 11, nil) }
+    assert_equal([nil, nil, breakpoint, nil, nil, breakpoint], hits)
+    assert_equal(6, breakpoint.hit_count)
+    breakpoint.hit_condition = :equal
+    breakpoint.hit_value = 7
+    assert_equal(breakpoint, Debugger::Breakpoint.find(Debugger.breakpoints, "foo.rb", 11, nil))
+    assert_nil(Debugger::Breakpoint.find(Debugger.breakpoints, "foo.rb", 11, nil))
+    breakpoint.hit_condition = :greater_or_equal
+    assert_equal(breakpoint, Debugger::Breakpoint.find(Debugger.breakpoints, "foo.rb", 11, nil))
+    assert_raise(ArgumentError) { breakpoint.hit_condition = :sometimes }
+  ensure
+    Debugger.stop
+  end
+
+  def test_thread_filter
+    Debugger.start
+    Debugger.breakpoints.clear
+    thread = Thread.new { sleep }
+    breakpoint = Debugger.add_breakpoint("foo.rb", 11, nil, :thread => thread)
+    assert_nil(Debugger::Breakpoint.find(Debugger.breakpoints, "foo.rb", 11, nil))
+    assert_equal(0, breakpoint.hit_count)
+    breakpoint.thread = Thread.current
+    assert_equal(breakpoint, Debugger::Breakpoint.find(Debugger.breakpoints, "foo.rb", 11, nil))
+  ensure
+    thread.kill if thread
+    Debugger.stop
+  end
+
+  def logged_method(value)
+    value * 2
+  end
+
+  def test_logpoint
+    Debugger.start
+    Debugger.breakpoints.clear
+    Debugger.flush_logpoints
+    line = method(:logged_method).source_location[1] + 1
+    breakpoint = Debugger.add_logpoint(__FILE__, line, "value={value}, {")
+    logged_method(21)
+    assert_equal(["value=21, {"], Debugger.flush_logpoints)
+    assert_equal(1, breakpoint.hit_count)
+    assert_nil(Debugger::Breakpoint.find(Debugger.breakpoints, __FILE__, line, nil))
+
+    dropped = Debugger.logpoints_dropped
+    Debugger.logpoint_buffer_size = 2
+    [1, 2, 3].each { |value| logged_method(value) }
+    assert_equal(["value=2, {", "value=3, {"], Debugger.flush_logpoints)
+    assert_equal(dropped + 1, Debugger.logpoints_dropped)
+  ensure
+    Debugger.logpoint_buffer_size = 1024
+    Debugger.stop
+  end
+end
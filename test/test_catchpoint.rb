@@ -16,4 +16,49 @@ class TestRubyDebugCatchpoint < Test::Unit::TestCase
   ensure
     Debugger.stop
   end
+
+  class NullHandler
+    def at_catchpoint(context, exception); end
+    def at_line(context, file, line); end
+  end
+
+  def raise_and_rescue(exception_class, message)
+    raise exception_class, message
+  rescue exception_class
+  end
+
+  def test_catchpoint_predicates
+    Debugger.handler = NullHandler.new
+    Debugger.start_
+    Debugger.add_catchpoint('ArgumentError', :message => 'boom')
+    Debugger.add_catchpoint('StandardError', :exact => true)
+    raise_and_rescue(ArgumentError, 'other')
+    raise_and_rescue(ArgumentError, 'boom!')
+    raise_and_rescue(RuntimeError, 'boom')
+    raise_and_rescue(StandardError, 'boom')
+    assert_equal({'ArgumentError' => 1, 'StandardError' => 1}, Debugger.catchpoints)
+
+    Debugger.remove_catchpoint('StandardError')
+    Debugger.add_catchpoint('RuntimeError')
+    raise_and_rescue(RuntimeError, 'boom')
+    assert_equal(1, Debugger.catchpoints['RuntimeError'])
+  ensure
+    Debugger.clear_catchpoints
+    Debugger.handler = nil
+    Debugger.stop
+  end
+
+  def test_catchpoint_message_falls_through_to_ancestor
+    Debugger.handler = NullHandler.new
+    Debugger.start_
+    Debugger.add_catchpoint('ArgumentError', :message => 'boom')
+    Debugger.add_catchpoint('StandardError')
+    raise_and_rescue(ArgumentError, 'other')
+    raise_and_rescue(ArgumentError, 'boom')
+    assert_equal({'ArgumentError' => 1, 'StandardError' => 1}, Debugger.catchpoints)
+  ensure
+    Debugger.clear_catchpoints
+    Debugger.handler = nil
+    Debugger.stop
+  end
 end
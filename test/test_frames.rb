@@ -0,0 +1,69 @@
+#!/usr/bin/env ruby
+require File.expand_path("helper", File.dirname(__FILE__))
+require "json"
+
+# Test frames collected when the debugger stops.
+class TestFrames < Test::Unit::TestCase
+  class FrameRecorder
+    attr_reader :frames
+
+    def at_breakpoint(context, breakpoint)
+    end
+
+    def at_line(context, file, line)
+      @frames = (0...context.stack_size).map do |i|
+        [context.frame_file(i), context.frame_line(i)]
+      end
+      @local = context.frame_binding(0).local_variable_get(:value)
+      @caller_self = context.frame_self(1)
+      @caller_binding = context.frame_binding(1)
+      @window = context.frames(1, 1)
+      @snapshot = context.snapshot(2, 8)
+    end
+
+    attr_reader :local, :caller_self, :caller_binding, :window, :snapshot
+  end
+
+  def stopped_method(value)
+    value * 2
+  end
+
+  def test_frames_at_breakpoint
+    recorder = FrameRecorder.new
+    Debugger.handler = recorder
+    Debugger.start_
+    Debugger.breakpoints.clear
+    line = method(:stopped_method).source_location[1] + 1
+    Debugger.add_breakpoint(__FILE__, line)
+    stopped_method(21)
+    assert_equal([__FILE__, line], recorder.frames[0])
+    assert_equal([__FILE__, __LINE__ - 2], recorder.frames[1])
+    assert_equal(21, recorder.local)
+    assert_same(self, recorder.caller_self)
+    assert_same(recorder, recorder.caller_binding.local_variable_get(:recorder))
+    assert_equal([[__FILE__, __LINE__ - 5, "test_frames_at_breakpoint", TestFrames]], recorder.window)
+  ensure
+    Debugger.handler = nil
+    Debugger.stop
+  end
+
+  def test_snapshot
+    recorder = FrameRecorder.new
+    Debugger.handler = recorder
+    Debugger.start_
+    Debugger.breakpoints.clear
+    line = method(:stopped_method).source_location[1] + 1
+    Debugger.add_breakpoint(__FILE__, line)
+    call_line = __LINE__; stopped_method("a \"long\" string")
+    snapshot = JSON.parse(recorder.snapshot)
+    assert_equal(Debugger.current_context.thnum, snapshot["thread"]["thnum"])
+    assert_equal("breakpoint", snapshot["stop_reason"])
+    assert_equal(2, snapshot["frames"].size)
+    assert_equal({"file" => __FILE__, "line" => line, "method" => "stopped_method", "class" => "TestFrames"}, snapshot["frames"][0])
+    assert_equal(call_line, snapshot["frames"][1]["line"])
+    assert_equal([{"name" => "value", "class" => "String", "value" => "\"a \\\"lon..."}], snapshot["locals"])
+  ensure
+    Debugger.handler = nil
+    Debugger.stop
+  end
+end
@@ -0,0 +1,27 @@
+#!/usr/bin/env ruby
+require File.expand_path("helper", File.dirname(__FILE__))
+
+# Test the sampling profiler.
+class TestSampling < Test::Unit::TestCase
+  def busy_method
+    deadline = Process.clock_gettime(Process::CLOCK_PROCESS_CPUTIME_ID) + 0.2
+    x = 0
+    x += 1 while Process.clock_gettime(Process::CLOCK_PROCESS_CPUTIME_ID) < deadline
+    x
+  end
+
+  def test_sampling
+    omit_if(Gem.win_platform?)
+    Debugger.start_sampling(interval: 0.001)
+    assert_equal(true, Debugger.sampling?)
+    busy_method
+    Debugger.stop_sampling
+    assert_equal(false, Debugger.sampling?)
+    assert_operator(Debugger.sampler_stats[:samples], :>, 0)
+    assert_match(/busy_method/, Debugger.sampled_folded_stacks)
+    profile = Zlib::GzipReader.new(StringIO.new(Debugger.sampled_pprof)).read
+    assert_include(profile, "busy_method")
+  ensure
+    Debugger.stop_sampling
+  end
+end
@@ -0,0 +1,48 @@
+#!/usr/bin/env ruby
+require File.expand_path("helper", File.dirname(__FILE__))
+require "socket"
+require "tmpdir"
+
+# Test starting the debugger on a signal.
+class TestSignalStart < Test::Unit::TestCase
+  START_SCRIPT = <<-'RUBY'
+    require "socket"
+    server = UNIXServer.new(ENV["DEBASE_TEST_SOCKET"])
+    Debase::DebugThread.new do
+      client = server.accept
+      Debase.start_
+      client.puts "started #{Debase.started?}"
+      client.close
+    end
+  RUBY
+
+  DEBUGGEE = <<-'RUBY'
+    require "debase"
+    puts "started #{Debase.started?}"
+    STDOUT.flush
+    loop { sleep 0.01 }
+  RUBY
+
+  def test_start_on_signal
+    omit_if(Gem.win_platform?)
+    Dir.mktmpdir do |dir|
+      script = File.join(dir, "start.rb")
+      socket = File.join(dir, "debase.sock")
+      File.write(script, START_SCRIPT)
+      env = {"DEBASE_START_SCRIPT" => script, "DEBASE_TEST_SOCKET" => socket}
+      load_path = ["-I", File.expand_path("../lib", File.dirname(__FILE__)), "-I", File.expand_path("../ext", File.dirname(__FILE__))]
+      IO.popen(env, [Gem.ruby, *load_path, "-e", DEBUGGEE]) do |io|
+        begin
+          assert_equal("started false", io.gets.chomp)
+          assert_false(File.exist?(socket))
+          Process.kill(:USR2, io.pid)
+          deadline = Time.now + 5
+          sleep 0.01 until File.exist?(socket) || Time.now > deadline
+          UNIXSocket.open(socket) { |client| assert_equal("started true", client.gets.chomp) }
+        ensure
+          Process.kill(:KILL, io.pid)
+        end
+      end
+    end
+  end
+end
@@ -0,0 +1,95 @@
+#!/usr/bin/env ruby
+require File.expand_path("helper", File.dirname(__FILE__))
+
+# Test stepping commands issued at a breakpoint.
+class TestStepping < Test::Unit::TestCase
+  class StepRecorder
+    attr_reader :lines, :counts
+
+    def initialize(&command)
+      @command = command
+      @lines = []
+      @counts = []
+    end
+
+    def at_breakpoint(context, breakpoint)
+      Debugger.remove_breakpoint(breakpoint.id)
+    end
+
+    def at_line(context, file, line)
+      @lines << line
+      # handlers run before the event of the stop is counted
+      @counts << Debugger.stats.values_at(:line_event, :call_event, :return_event).map { |stat| stat[:count] }
+      @command.call(context) if @lines.size == 1
+    end
+  end
+
+  def nested
+    1
+  end
+
+  def callee
+    x = nested
+    x + 1
+  end
+
+  def stepped_method
+    y = callee
+    y + 1
+  end
+
+  def run_stepping(line, lazy_stack_depth = false, &command)
+    recorder = StepRecorder.new(&command)
+    Debugger.handler = recorder
+    Debugger.lazy_stack_depth = lazy_stack_depth
+    Debugger.start_
+    Debugger.breakpoints.clear
+    Debugger.add_breakpoint(__FILE__, line)
+    stepped_method
+    recorder
+  ensure
+    Debugger.handler = nil
+    Debugger.lazy_stack_depth = false
+    Debugger.stop
+  end
+
+  def test_step_over
+    line = method(:stepped_method).source_location[1] + 1
+    recorder = run_stepping(line) do |context|
+      context.step_over(1, 0)
+      Debugger.reset_stats
+    end
+    assert_equal([line, line + 1], recorder.lines)
+    if RUBY_VERSION >= '2.6'
+      # callee and nested run without line, call and return handlers,
+      # only the line event of the first stop is counted after the reset
+      assert_equal([1, 0, 0], recorder.counts[1])
+    end
+  end
+
+  def test_finish
+    line = method(:callee).source_location[1] + 1
+    recorder = run_stepping(line) do |context|
+      context.stop_frame = 0
+      Debugger.reset_stats
+    end
+    assert_equal([line, method(:stepped_method).source_location[1] + 2], recorder.lines)
+    if RUBY_VERSION >= '2.6'
+      # only returns of callee are traced, the call of nested is not hooked
+      assert_equal(0, Debugger.stats[:call_event][:count])
+      assert_equal(0, Debugger.stats[:return_event][:count])
+    end
+  end
+
+  def test_step_over_with_lazy_stack_depth
+    line = method(:stepped_method).source_location[1] + 1
+    lines = run_stepping(line, true) { |context| context.step_over(1, 0) }.lines
+    assert_equal([line, line + 1], lines)
+  end
+
+  def test_finish_with_lazy_stack_depth
+    line = method(:callee).source_location[1] + 1
+    lines = run_stepping(line, true) { |context| context.stop_frame = 0 }.lines
+    assert_equal([line, method(:stepped_method).source_location[1] + 2], lines)
+  end
+end